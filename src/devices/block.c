@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
 #include "threads/malloc.h"
 
 /* A block device. */
@@ -17,8 +19,8 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
-    unsigned long long read_cnt;        /* Number of sectors read. */
-    unsigned long long write_cnt;       /* Number of sectors written. */
+    struct iostat stats;                /* Statistics.  Updated with
+                                           interrupts off. */
   };
 
 /* List of all block devices. */
@@ -28,6 +30,13 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void record_time (uint64_t hist[IOSTAT_BUCKETS], uint64_t *total,
+                         uint64_t cycles);
+static void record_completion (struct block *, struct block_request *,
+                               uint64_t now);
+static void print_histogram (const char *name,
+                             const uint64_t hist[IOSTAT_BUCKETS],
+                             uint64_t total);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -99,17 +108,19 @@ block_get_by_name (const char *name)
   return NULL;
 }
 
-/* Verifies that SECTOR is a valid offset within BLOCK.
+/* Verifies that the CNT sectors starting at SECTOR are valid
+   offsets within BLOCK and that CNT is nonzero.
    Panics if not. */
 static void
-check_sector (struct block *block, block_sector_t sector)
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
 {
-  if (sector >= block->size)
+  if (sector >= block->size || cnt == 0 || cnt > block->size - sector)
     {
       /* We do not use ASSERT because we want to panic here
          regardless of whether NDEBUG is defined. */
       PANIC ("Access past end of device %s (sector=%"PRDSNu", "
-             "size=%"PRDSNu")\n", block_name (block), sector, block->size);
+             "count=%zu, size=%"PRDSNu")\n",
+             block_name (block), sector, cnt, block->size);
     }
 }
 
@@ -120,9 +131,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, buffer, 1);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +142,107 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, buffer, 1);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK into BUFFER, which must have room for CNT *
+   BLOCK_SECTOR_SIZE bytes.  The driver transfers them with as
+   few device requests as it can, so this is faster than CNT
+   calls to block_read(). */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  struct block_request r;
+
+  block_request_init (&r, sector, buffer, cnt, false);
+  block_submit (block, &r);
+  block_wait (&r);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes,
+   with as few device requests as the driver can.  Returns after
+   the block device has acknowledged receiving the data. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  struct block_request r;
+
+  /* The request is a write, so BUFFER is only read from. */
+  block_request_init (&r, sector, (void *) buffer, cnt, true);
+  block_submit (block, &r);
+  block_wait (&r);
+}
+
+/* Initializes R as a request to transfer the CNT sectors
+   starting at SECTOR between a block device and BUFFER: to the
+   device if WRITE is true, from it otherwise.  R has no
+   completion function. */
+void
+block_request_init (struct block_request *r, block_sector_t sector,
+                    void *buffer, size_t cnt, bool write)
+{
+  r->sector = sector;
+  r->buffer = buffer;
+  r->cnt = cnt;
+  r->write = write;
+  r->done = NULL;
+  r->aux = NULL;
+  r->block = r->device = NULL;
+  sema_init (&r->finished, 0);
+}
+
+/* Queues R, initialized with block_request_init(), on BLOCK and
+   returns without waiting for it, unless BLOCK's driver can only
+   transfer synchronously.  Panics if R's sectors are not all
+   within BLOCK. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  struct iostat *s = &block->stats;
+  enum intr_level old_level;
+
+  check_sectors (block, r->sector, r->cnt);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  /* A request that a partition passes on to its disk counts
+     toward both. */
+  old_level = intr_disable ();
+  if (r->block == NULL)
+    {
+      r->block = block;
+      r->submit_tsc = rdtsc ();
+    }
+  r->device = block;
+  s->submit_cnt++;
+  s->depth++;
+  s->depth_sum += s->depth;
+  if (s->depth > s->max_depth)
+    s->max_depth = s->depth;
+  intr_set_level (old_level);
+
+  if (block->ops->submit != NULL)
+    block->ops->submit (block->aux, r);
+  else
+    {
+      block_dispatched (r, false);
+      if (r->write)
+        block->ops->write (block->aux, r->sector, r->buffer, r->cnt);
+      else
+        block->ops->read (block->aux, r->sector, r->buffer, r->cnt);
+      block_complete (r);
+    }
+}
+
+/* Waits for R, which must have been passed to block_submit(), to
+   complete. */
+void
+block_wait (struct block_request *r)
+{
+  sema_down (&r->finished);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -173,11 +279,108 @@ block_print_stats (void)
         {
           printf ("%s (%s): %llu reads, %llu writes\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->stats.read_bytes / BLOCK_SECTOR_SIZE,
+                  block->stats.write_bytes / BLOCK_SECTOR_SIZE);
         }
     }
 }
 
+/* Prints detailed I/O statistics for every block device. */
+void
+block_print_iostat (void)
+{
+  struct block *block;
+
+  for (block = block_first (); block != NULL; block = block_next (block))
+    {
+      struct iostat s;
+
+      block_get_iostat (block, &s);
+      printf ("%s (%s): %llu reads (%llu bytes), "
+              "%llu writes (%llu bytes), %llu merged\n",
+              block->name, block_type_name (block->type),
+              s.read_cnt, s.read_bytes, s.write_cnt, s.write_bytes,
+              s.merge_cnt);
+      if (s.submit_cnt == 0)
+        continue;
+      printf ("  queue depth: %llu.%02llu average, %u max, %u now\n",
+              s.depth_sum / s.submit_cnt,
+              s.depth_sum * 100 / s.submit_cnt % 100,
+              (unsigned) s.max_depth, (unsigned) s.depth);
+      print_histogram ("queue wait", s.wait_hist, s.wait_cycles);
+      print_histogram ("service", s.service_hist, s.service_cycles);
+    }
+}
+
+/* Copies BLOCK's I/O statistics into S. */
+void
+block_get_iostat (struct block *block, struct iostat *s)
+{
+  enum intr_level old_level = intr_disable ();
+  *s = block->stats;
+  intr_set_level (old_level);
+}
+
+/* Adds CYCLES to *TOTAL and counts it in histogram HIST. */
+static void
+record_time (uint64_t hist[IOSTAT_BUCKETS], uint64_t *total,
+             uint64_t cycles)
+{
+  int bucket = 0;
+
+  *total += cycles;
+  cycles >>= IOSTAT_MIN_SHIFT + 1;
+  while (cycles > 0 && bucket < IOSTAT_BUCKETS - 1)
+    {
+      cycles >>= 1;
+      bucket++;
+    }
+  hist[bucket]++;
+}
+
+/* Counts the completion, at timestamp NOW, of request R in
+   BLOCK's statistics.  Interrupts must be off. */
+static void
+record_completion (struct block *block, struct block_request *r,
+                   uint64_t now)
+{
+  struct iostat *s = &block->stats;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (r->write)
+    {
+      s->write_cnt++;
+      s->write_bytes += (uint64_t) r->cnt * BLOCK_SECTOR_SIZE;
+    }
+  else
+    {
+      s->read_cnt++;
+      s->read_bytes += (uint64_t) r->cnt * BLOCK_SECTOR_SIZE;
+    }
+  s->depth--;
+  record_time (s->service_hist, &s->service_cycles, now - r->dispatch_tsc);
+}
+
+/* Prints histogram HIST of times adding up to TOTAL cycles,
+   labeled NAME, skipping empty buckets. */
+static void
+print_histogram (const char *name, const uint64_t hist[IOSTAT_BUCKETS],
+                 uint64_t total)
+{
+  uint64_t cnt = 0;
+  int i;
+
+  for (i = 0; i < IOSTAT_BUCKETS; i++)
+    cnt += hist[i];
+  printf ("  %s: %llu cycles average\n", name, cnt > 0 ? total / cnt : 0);
+  for (i = 0; i < IOSTAT_BUCKETS; i++)
+    if (hist[i] > 0)
+      printf ("    %s2^%-2d cycles: %llu\n",
+              i == 0 ? "< " : i == IOSTAT_BUCKETS - 1 ? ">=" : "  ",
+              IOSTAT_MIN_SHIFT + (i == 0 ? 1 : i), hist[i]);
+}
+
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
@@ -198,8 +401,7 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
-  block->read_cnt = 0;
-  block->write_cnt = 0;
+  memset (&block->stats, 0, sizeof block->stats);
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -211,6 +413,45 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Called by a driver, possibly from an interrupt handler, when
+   it starts transferring request R.  MERGED is true if R shares
+   the transfer with a request dispatched before it. */
+void
+block_dispatched (struct block_request *r, bool merged)
+{
+  enum intr_level old_level = intr_disable ();
+  uint64_t wait;
+
+  r->dispatch_tsc = rdtsc ();
+  wait = r->dispatch_tsc - r->submit_tsc;
+  record_time (r->device->stats.wait_hist, &r->device->stats.wait_cycles,
+               wait);
+  if (r->block != r->device)
+    record_time (r->block->stats.wait_hist, &r->block->stats.wait_cycles,
+                 wait);
+  if (merged)
+    r->device->stats.merge_cnt++;
+  intr_set_level (old_level);
+}
+
+/* Called by a driver, possibly from an interrupt handler, when
+   it has finished transferring request R. */
+void
+block_complete (struct block_request *r)
+{
+  enum intr_level old_level = intr_disable ();
+  uint64_t now = rdtsc ();
+
+  record_completion (r->device, r, now);
+  if (r->block != r->device)
+    record_completion (r->block, r, now);
+  intr_set_level (old_level);
+
+  if (r->done != NULL)
+    r->done (r);
+  sema_up (&r->finished);
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
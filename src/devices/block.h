@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <iostat.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,22 +56,79 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *,
+                          size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous block device requests.
+
+   block_submit() queues a request and returns at once.  When the
+   transfer is done, the driver calls the request's DONE function,
+   if any, from an interrupt handler, so it must not sleep; then
+   block_wait() on the request returns.  The request and its
+   buffer must stay put until then. */
+struct block_request;
+typedef void block_done_func (struct block_request *);
+
+struct block_request
+  {
+    /* Set by block_request_init(), except DONE and AUX, which
+       the submitter may set afterward. */
+    block_sector_t sector;      /* First sector.  Drivers may rebase it
+                                   onto an underlying device. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    size_t cnt;                 /* Number of sectors. */
+    bool write;                 /* Write if true, read if false. */
+    block_done_func *done;      /* Called on completion, if nonnull. */
+    void *aux;                  /* For DONE's use. */
+
+    /* Owned by the driver while the request is pending. */
+    struct list_elem elem;      /* Element in driver's sorted queue. */
+    struct list_elem fifo_elem; /* Element in driver's arrival queue. */
+    int64_t deadline;           /* Timer tick to dispatch by. */
+
+    /* Owned by the block layer, for statistics. */
+    struct block *block;        /* Device first submitted to. */
+    struct block *device;       /* Device whose driver queued it. */
+    uint64_t submit_tsc;        /* Timestamp of submission. */
+    uint64_t dispatch_tsc;      /* Timestamp of start of transfer. */
+
+    struct semaphore finished;  /* Up'd on completion. */
+  };
+
+void block_request_init (struct block_request *, block_sector_t,
+                         void *buffer, size_t cnt, bool write);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
+void block_print_iostat (void);
+void block_get_iostat (struct block *, struct iostat *);
 
 /* Lower-level interface to block device drivers. */
 
+/* A driver either provides READ and WRITE, which transfer the
+   CNT consecutive sectors that start at the given sector before
+   returning, or SUBMIT, which queues a request and arranges for
+   block_complete() to be called on it when it is done.  The
+   block layer ensures that each request's count is nonzero and
+   that all its sectors exist. */
 struct block_operations
   {
-    void (*read) (void *aux, block_sector_t, void *buffer);
-    void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read) (void *aux, block_sector_t, void *buffer, size_t cnt);
+    void (*write) (void *aux, block_sector_t, const void *buffer,
+                   size_t cnt);
+    void (*submit) (void *aux, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_dispatched (struct block_request *, bool merged);
+void block_complete (struct block_request *);
 
 #endif /* devices/block.h */
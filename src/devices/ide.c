@@ -5,13 +5,40 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   If the controller is a PCI bus-master IDE controller, such as
+   the PIIX that QEMU emulates, and the disk supports it, sectors
+   are transferred by DMA: the controller copies the data between
+   the disk and memory by itself, so the CPU is free to run other
+   threads until the completion interrupt arrives.  Otherwise,
+   and whenever a DMA transfer fails, the CPU copies the data
+   word by word through the data register ("PIO").
+
+   Transfers are asynchronous.  Each disk has a queue of pending
+   block requests, kept sorted by sector.  Whenever a channel is
+   idle, dispatch() picks a disk and a request by the elevator
+   rules described at choose_request(), merges in the requests
+   that follow it on disk, and issues the command for the
+   resulting batch.  The interrupt handler moves PIO data and
+   notices the end of each command, then completes the requests
+   and dispatches the next batch, so the disk is kept busy
+   without any thread waiting on it.  The queues and the
+   channel's transfer state are protected by disabling
+   interrupts. */
+
+/* If false (default), transfer sectors by DMA where possible.
+   If true, always use PIO.
+   Controlled by kernel command-line option "-pio". */
+bool ide_pio_only;
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -34,6 +61,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +77,49 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Bus master IDE registers, as offsets from a channel's
+   bm_base. */
+#define BM_COMMAND 0            /* Command. */
+#define BM_STATUS 2             /* Status. */
+#define BM_PRDT 4               /* Physical address of PRD table. */
+
+/* Bus master Command Register bits. */
+#define BMC_START 0x01          /* Start transfer. */
+#define BMC_READ 0x08           /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  The last two are cleared by
+   writing 1 to them. */
+#define BMS_ACTIVE 0x01         /* Transfer in progress. */
+#define BMS_ERROR 0x02          /* Transfer failed. */
+#define BMS_INTR 0x04           /* Disk raised its interrupt. */
+
+/* A physical region descriptor, which gives the bus master one
+   physically contiguous region of memory to transfer.  A region
+   may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes; 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT if last in table. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_CNT 32              /* Descriptors per channel. */
+
+/* Most sectors that a single READ or WRITE command can
+   transfer, and most sectors merged into one batch. */
+#define MAX_TRANSFER 256
+
+/* How long a request may wait before it is dispatched ahead of
+   the elevator order.  Reads get the shorter deadline because a
+   thread is usually waiting for them. */
+#define READ_EXPIRE (TIMER_FREQ / 10)   /* Ticks a read may wait. */
+#define WRITE_EXPIRE TIMER_FREQ         /* Ticks a write may wait. */
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +128,18 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool use_dma;               /* Transfer sectors by DMA? */
+    uint8_t multiple_cnt;       /* Sectors per PIO interrupt with READ/WRITE
+                                   MULTIPLE, 0 if not supported. */
+
+    struct list queue;          /* Pending requests, by sector. */
+    struct list fifo;           /* Pending requests, oldest first. */
+    block_sector_t head;        /* Sector after the last one dispatched. */
+
+    /* Statistics. */
+    unsigned long long command_cnt;     /* Commands issued. */
+    unsigned long long batch_cnt;       /* Batches dispatched. */
+    unsigned long long seek_total;      /* Sectors between batches. */
   };
 
 /* An ATA channel (aka controller).
@@ -66,13 +149,32 @@ struct channel
     char name[8];               /* Name, e.g. "ide0". */
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
+    uint16_t bm_base;           /* Bus master registers, 0 if none. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
-    struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct semaphore completion_wait;   /* Up'd by interrupt handler
+                                           while detecting disks. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
+
+    /* Batch being transferred. */
+    struct ata_disk *active;    /* Disk transferring, or NULL if idle. */
+    int next_dev;               /* Disk to try first at next dispatch. */
+    struct list batch;          /* Requests in the batch, by sector. */
+    bool batch_dma;             /* Transfer the batch by DMA? */
+    size_t batch_left;          /* Sectors of batch not yet transferred. */
+    struct block_request *cur;  /* Request holding next sector. */
+    size_t cur_ofs;             /* Sectors of CUR already transferred. */
+
+    /* Command in progress, covering part or all of the batch. */
+    bool cmd_dma;               /* Is it a DMA command? */
+    size_t cmd_cnt;             /* Sectors it transfers. */
+    size_t cmd_left;            /* Sectors not yet moved by PIO. */
+
+    /* PRD table for DMA.  The alignment keeps it from crossing
+       a 64 kB boundary, which the bus master does not allow. */
+    struct prd prdt[PRD_CNT] __attribute__ ((aligned (256)));
   };
 
 /* We support the two "legacy" ATA channels found in a standard PC. */
@@ -81,19 +183,30 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t,
+                           size_t sector_cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
+static list_less_func request_less;
+static void dispatch (struct channel *);
+static void start_command (struct channel *);
+static bool build_prdt (struct channel *);
+static void pio_block (struct channel *);
+static void advance (struct channel *, size_t cnt);
+static void transfer_interrupt (struct channel *);
+
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
 static void select_device (const struct ata_disk *);
 static void select_device_wait (const struct ata_disk *);
+static void wait_for_drq (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
@@ -101,6 +214,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = ide_pio_only ? 0 : find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -123,9 +237,12 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
-      lock_init (&c->lock);
+      c->bm_base = bm_base != 0 ? bm_base + 8 * chan_no : 0;
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->active = NULL;
+      c->next_dev = 0;
+      list_init (&c->batch);
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +253,13 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->use_dma = false;
+          d->multiple_cnt = 0;
+          list_init (&d->queue);
+          list_init (&d->fifo);
+          d->head = 0;
+          d->command_cnt = d->batch_cnt = 0;
+          d->seek_total = 0;
         }
 
       /* Register interrupt handler. */
@@ -158,6 +282,39 @@ ide_init (void)
 /* Disk detection and identification. */
 
 static char *descramble_ata_string (char *, int size);
+static void set_multiple_mode (struct ata_disk *, const char *id);
+
+/* Looks for a PCI IDE controller that can act as a bus master
+   for the two legacy channels, and enables it to do so.  Returns
+   the I/O port base of its bus master registers, or 0 if there
+   is no such controller. */
+static uint16_t
+find_bus_master (void) 
+{
+  struct pci_func f;
+  uint32_t prog_if, bar;
+
+  /* Class 1, subclass 1 is an IDE controller.  Its programming
+     interface says whether it can be a bus master (bit 7) and
+     whether each channel is in native mode (bits 0 and 2), in
+     which case it would not be at the legacy ports we use. */
+  if (!pci_find_class (0x01, 0x01, &f))
+    return 0;
+  prog_if = (pci_read_config (&f, PCI_REG_CLASS) >> 8) & 0xff;
+  if (!(prog_if & 0x80) || (prog_if & 0x05))
+    return 0;
+
+  /* Base address register 4 locates the bus master registers,
+     which must be in I/O space. */
+  bar = pci_read_config (&f, PCI_REG_BAR (4));
+  if (!(bar & 1) || (bar & 0xfffc) == 0)
+    return 0;
+
+  pci_write_config (&f, PCI_REG_COMMAND,
+                    (pci_read_config (&f, PCI_REG_COMMAND)
+                     | PCI_CMD_IO | PCI_CMD_MASTER));
+  return bar & 0xfffc;
+}
 
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
@@ -286,8 +443,11 @@ identify_ata_device (struct ata_disk *d)
   capacity = *(uint32_t *) &id[60 * 2];
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
+  d->use_dma = c->bm_base != 0 && (id[49 * 2 + 1] & 0x01) != 0;
+  set_multiple_mode (d, id);
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->use_dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -309,6 +469,28 @@ identify_ata_device (struct ata_disk *d)
   partition_scan (block);
 }
 
+/* Enables READ MULTIPLE and WRITE MULTIPLE on disk D, whose
+   IDENTIFY DEVICE response is ID, so that PIO transfers take an
+   interrupt per block of sectors instead of per sector.  Leaves
+   D's multiple_cnt at 0 if the disk does not support them. */
+static void
+set_multiple_mode (struct ata_disk *d, const char *id) 
+{
+  struct channel *c = d->channel;
+  uint8_t max_cnt = id[47 * 2];
+
+  if (max_cnt <= 1)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), max_cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (!(inb (reg_alt_status (c)) & STA_ERR))
+    d->multiple_cnt = max_cnt;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +519,66 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Queues request R for disk D and, if D's channel is idle,
+   starts transferring it.  The interrupt handler completes R
+   when its transfer is done. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_submit (void *d_, struct block_request *r)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  r->deadline = timer_ticks () + (r->write ? WRITE_EXPIRE : READ_EXPIRE);
+  list_insert_ordered (&d->queue, &r->elem, request_less, NULL);
+  list_push_back (&d->fifo, &r->fifo_elem);
+  if (c->active == NULL)
+    dispatch (c);
+  intr_set_level (old_level);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
-static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+/* Prints request scheduling statistics for each ATA disk. */
+void
+ide_print_stats (void) 
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  size_t chan_no;
+  int dev_no;
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    for (dev_no = 0; dev_no < 2; dev_no++) 
+      {
+        struct ata_disk *d = &channels[chan_no].devices[dev_no];
+        if (d->is_ata && d->batch_cnt > 0)
+          printf ("%s: %llu commands, %llu batches, "
+                  "%llu sectors average seek\n",
+                  d->name, d->command_cnt, d->batch_cnt,
+                  d->seek_total / d->batch_cnt);
+      }
 }
 
 static struct block_operations ide_operations =
   {
-    ide_read,
-    ide_write
+    NULL,
+    NULL,
+    ide_submit
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and SECTOR_CNT, which must be between 1 and
+   MAX_TRANSFER, to the disk's sector selection registers.  (We
+   use LBA mode.  A count of MAX_TRANSFER goes to the disk as 0,
+   which it takes to mean 256.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t sector_cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (sector_cnt >= 1 && sector_cnt <= MAX_TRANSFER);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), sector_cnt & 0xff);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,13 +615,347 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Request scheduling. */
+
+/* Returns true if request A's first sector precedes request
+   B's. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED) 
+{
+  const struct block_request *a = list_entry (a_, struct block_request,
+                                              elem);
+  const struct block_request *b = list_entry (b_, struct block_request,
+                                              elem);
+  return a->sector < b->sector;
+}
+
+/* Returns the request after R in its channel's batch, or a null
+   pointer if R is the last. */
+static struct block_request *
+next_request (struct channel *c, struct block_request *r) 
+{
+  struct list_elem *e = list_next (&r->elem);
+  return (e != list_end (&c->batch)
+          ? list_entry (e, struct block_request, elem)
+          : NULL);
+}
+
+/* Chooses the request to dispatch next from D's queue, which
+   must not be empty: the oldest request if it has waited past
+   its deadline, otherwise the first one at or after D's head,
+   wrapping around to the lowest sector if there is none
+   (C-LOOK). */
+static struct block_request *
+choose_request (struct ata_disk *d) 
+{
+  struct block_request *oldest = list_entry (list_front (&d->fifo),
+                                             struct block_request,
+                                             fifo_elem);
+  struct list_elem *e;
+
+  if (timer_ticks () >= oldest->deadline)
+    return oldest;
+  for (e = list_begin (&d->queue); e != list_end (&d->queue);
+       e = list_next (e)) 
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= d->head)
+        return r;
+    }
+  return list_entry (list_front (&d->queue), struct block_request, elem);
+}
+
+/* Returns true if the bus master can transfer R's buffer: it
+   must be word-aligned, because the bus master transfers words,
+   and in the kernel's mapping of physical memory, because it
+   uses physical addresses. */
+static bool
+dma_capable (const struct block_request *r) 
+{
+  return ((uintptr_t) r->buffer & 1) == 0 && is_kernel_vaddr (r->buffer);
+}
+
+/* If a disk on channel C, which must be idle, has requests
+   pending, chooses one, merges into it the requests that
+   continue it on disk in the same direction, up to MAX_TRANSFER
+   sectors in all, and starts transferring the resulting batch.
+   The disks take turns, so that neither starves the other.
+   Interrupts must be off. */
+static void
+dispatch (struct channel *c) 
+{
+  struct ata_disk *d = NULL;
+  struct block_request *r;
+  bool write;
+  int i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (c->active == NULL);
+
+  for (i = 0; i < 2 && d == NULL; i++) 
+    {
+      struct ata_disk *candidate = &c->devices[(c->next_dev + i) % 2];
+      if (!list_empty (&candidate->queue))
+        d = candidate;
+    }
+  if (d == NULL)
+    return;
+  c->next_dev = (d->dev_no + 1) % 2;
+
+  r = choose_request (d);
+  d->seek_total += (r->sector > d->head
+                    ? r->sector - d->head
+                    : d->head - r->sector);
+  d->batch_cnt++;
+
+  write = r->write;
+  c->batch_dma = d->use_dma && dma_capable (r);
+  c->batch_left = 0;
+  for (;;) 
+    {
+      struct list_elem *next = list_next (&r->elem);
+
+      list_remove (&r->elem);
+      list_remove (&r->fifo_elem);
+      block_dispatched (r, !list_empty (&c->batch));
+      list_push_back (&c->batch, &r->elem);
+      c->batch_left += r->cnt;
+      d->head = r->sector + r->cnt;
+
+      if (next == list_end (&d->queue))
+        break;
+      r = list_entry (next, struct block_request, elem);
+      if (r->sector != d->head || r->write != write
+          || c->batch_left + r->cnt > MAX_TRANSFER
+          || (c->batch_dma && !dma_capable (r)))
+        break;
+    }
+
+  c->active = d;
+  c->cur = list_entry (list_front (&c->batch), struct block_request, elem);
+  c->cur_ofs = 0;
+  start_command (c);
+}
+
+/* Issues the command that transfers the next part of channel
+   C's batch, up to MAX_TRANSFER sectors, by DMA if possible and
+   otherwise by PIO.  Interrupts must be off. */
+static void
+start_command (struct channel *c) 
+{
+  struct ata_disk *d = c->active;
+  bool write = c->cur->write;
+
+  c->cmd_cnt = c->batch_left < MAX_TRANSFER ? c->batch_left : MAX_TRANSFER;
+  c->cmd_left = c->cmd_cnt;
+  c->cmd_dma = c->batch_dma && d->use_dma && build_prdt (c);
+  c->expecting_interrupt = true;
+  d->command_cnt++;
+
+  if (c->cmd_dma) 
+    {
+      /* Point the bus master at the table and clear its status,
+         then issue the command and start the transfer. */
+      uint8_t direction = write ? 0 : BMC_READ;
+      outl (c->bm_base + BM_PRDT, vtop (c->prdt));
+      outb (c->bm_base + BM_COMMAND, direction);
+      outb (c->bm_base + BM_STATUS, BMS_ERROR | BMS_INTR);
+      select_sector (d, c->cur->sector + c->cur_ofs, c->cmd_cnt);
+      outb (reg_command (c), write ? CMD_WRITE_DMA : CMD_READ_DMA);
+      outb (c->bm_base + BM_COMMAND, direction | BMC_START);
+    }
+  else 
+    {
+      /* Use READ or WRITE MULTIPLE if D supports them, so that
+         the disk interrupts once per block of multiple_cnt
+         sectors rather than once per sector.  On writes, the
+         disk interrupts after each block is written, so the
+         first block must go out now. */
+      select_sector (d, c->cur->sector + c->cur_ofs, c->cmd_cnt);
+      if (d->multiple_cnt > 0)
+        outb (reg_command (c),
+              write ? CMD_WRITE_MULTIPLE : CMD_READ_MULTIPLE);
+      else
+        outb (reg_command (c),
+              write ? CMD_WRITE_SECTOR_RETRY : CMD_READ_SECTOR_RETRY);
+      if (write) 
+        {
+          wait_for_drq (d);
+          pio_block (c);
+        }
+    }
+}
+
+/* Fills in channel C's PRD table to describe the buffers for the
+   next cmd_cnt sectors of its batch, splitting them at 64 kB
+   boundaries.  Returns false if that takes more than PRD_CNT
+   descriptors. */
+static bool
+build_prdt (struct channel *c) 
+{
+  struct block_request *r = c->cur;
+  size_t ofs = c->cur_ofs;
+  size_t left = c->cmd_cnt;
+  size_t i = 0;
+
+  while (left > 0) 
+    {
+      size_t cnt = r->cnt - ofs < left ? r->cnt - ofs : left;
+      uintptr_t addr = vtop ((uint8_t *) r->buffer + ofs * BLOCK_SECTOR_SIZE);
+      size_t size = cnt * BLOCK_SECTOR_SIZE;
+
+      while (size > 0) 
+        {
+          size_t chunk = 0x10000 - (addr & 0xffff);
+          if (chunk > size)
+            chunk = size;
+          if (i >= PRD_CNT)
+            return false;
+          c->prdt[i].addr = addr;
+          c->prdt[i].size = chunk;
+          c->prdt[i].flags = 0;
+          i++;
+          addr += chunk;
+          size -= chunk;
+        }
+      left -= cnt;
+      r = next_request (c, r);
+      ofs = 0;
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+  return true;
+}
+
+/* Moves the next block of channel C's PIO command through the
+   data register, to or from the batch's buffers: as many sectors
+   as the disk transfers per interrupt, or as many as remain. */
+static void
+pio_block (struct channel *c) 
+{
+  struct ata_disk *d = c->active;
+  size_t cnt = d->multiple_cnt > 0 ? d->multiple_cnt : 1;
+
+  if (cnt > c->cmd_left)
+    cnt = c->cmd_left;
+  c->cmd_left -= cnt;
+  for (; cnt > 0; cnt--) 
+    {
+      uint8_t *p = ((uint8_t *) c->cur->buffer
+                    + c->cur_ofs * BLOCK_SECTOR_SIZE);
+      if (c->cur->write)
+        output_sector (c, p);
+      else
+        input_sector (c, p);
+      advance (c, 1);
+    }
+}
+
+/* Advances channel C's batch cursor past CNT transferred
+   sectors.  The cursor stays on the last request once the whole
+   batch is done. */
+static void
+advance (struct channel *c, size_t cnt) 
+{
+  c->batch_left -= cnt;
+  while (cnt > 0) 
+    {
+      size_t n = c->cur->cnt - c->cur_ofs;
+      if (n > cnt)
+        n = cnt;
+      c->cur_ofs += n;
+      cnt -= n;
+      if (c->cur_ofs == c->cur->cnt && c->batch_left > 0) 
+        {
+          c->cur = next_request (c, c->cur);
+          c->cur_ofs = 0;
+        }
+    }
+}
+
+/* Removes the requests at the front of channel C's batch that
+   have been transferred completely and completes them. */
+static void
+complete_requests (struct channel *c) 
+{
+  while (!list_empty (&c->batch)) 
+    {
+      struct block_request *r = list_entry (list_front (&c->batch),
+                                            struct block_request, elem);
+      if (r == c->cur && c->cur_ofs < r->cnt)
+        break;
+      list_pop_front (&c->batch);
+      block_complete (r);
+    }
+}
+
+/* Handles an interrupt from channel C's active disk.  Moves the
+   next block of a PIO command, or checks the result of a DMA
+   command, falling back to PIO if it failed.  When the command
+   is done, completes the requests it finished and starts the
+   next command of the batch, or the next batch. */
+static void
+transfer_interrupt (struct channel *c) 
+{
+  struct ata_disk *d = c->active;
+  block_sector_t sec_no = c->cur->sector + c->cur_ofs;
+  bool write = c->cur->write;
+  uint8_t status;
+
+  status = inb (reg_status (c));        /* Acknowledge interrupt. */
+  if (c->cmd_dma) 
+    {
+      uint8_t direction = write ? 0 : BMC_READ;
+      uint8_t bm_status;
+
+      /* Stop the bus master and check for errors. */
+      outb (c->bm_base + BM_COMMAND, direction);
+      bm_status = inb (c->bm_base + BM_STATUS);
+      outb (c->bm_base + BM_STATUS, BMS_ERROR | BMS_INTR);
+      if ((bm_status & (BMS_ERROR | BMS_ACTIVE)) || (status & STA_ERR)) 
+        {
+          printf ("%s: DMA transfer failed, sector=%"PRDSNu", "
+                  "falling back to PIO\n", d->name, sec_no);
+          d->use_dma = false;
+          start_command (c);
+          return;
+        }
+      advance (c, c->cmd_cnt);
+      c->cmd_left = 0;
+    }
+  else 
+    {
+      /* A read interrupts when a block is ready to be read; a
+         write, when a block has been written.  Either way, the
+         disk raises DRQ if it wants another block. */
+      bool more = !write || c->cmd_left > 0;
+      if ((status & STA_ERR) || (more && !(status & STA_DRQ)))
+        PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+               d->name, write ? "write" : "read", sec_no);
+      if (more)
+        pio_block (c);
+      if (write ? more : c->cmd_left > 0)
+        return;
+    }
+
+  complete_requests (c);
+  if (c->batch_left > 0)
+    start_command (c);
+  else 
+    {
+      c->active = NULL;
+      dispatch (c);
+    }
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
    is, for the BSY and DRQ bits to clear in the status register.
 
    As a side effect, reading the status register clears any
-   pending interrupt. */
+   pending interrupt.  Does not sleep, so that dispatch() may
+   call it with interrupts off. */
 static void
 wait_until_idle (const struct ata_disk *d) 
 {
@@ -446,7 +965,7 @@ wait_until_idle (const struct ata_disk *d)
     {
       if ((inb (reg_status (d->channel)) & (STA_BSY | STA_DRQ)) == 0)
         return;
-      timer_usleep (10);
+      timer_udelay (10);
     }
 
   printf ("%s: idle timeout\n", d->name);
@@ -479,7 +998,33 @@ wait_while_busy (const struct ata_disk *d)
   return false;
 }
 
-/* Program D's channel so that D is now the selected disk. */
+/* Waits up to a second for disk D to clear BSY and raise DRQ.
+   Does not sleep, so that the interrupt handler may call it.
+   Panics if the disk reports an error or does not respond. */
+static void
+wait_for_drq (const struct ata_disk *d) 
+{
+  struct channel *c = d->channel;
+  int i;
+
+  for (i = 0; i < 100000; i++) 
+    {
+      uint8_t status = inb (reg_alt_status (c));
+      if (!(status & STA_BSY)) 
+        {
+          if (status & STA_ERR)
+            break;
+          if (status & STA_DRQ)
+            return;
+        }
+      timer_udelay (10);
+    }
+  PANIC ("%s: disk not ready for data", d->name);
+}
+
+/* Program D's channel so that D is now the selected disk.
+   Does not sleep, so that dispatch() may call it with interrupts
+   off. */
 static void
 select_device (const struct ata_disk *d)
 {
@@ -489,7 +1034,7 @@ select_device (const struct ata_disk *d)
     dev |= DEV_DEV;
   outb (reg_device (c), dev);
   inb (reg_alt_status (c));
-  timer_nsleep (400);
+  timer_ndelay (400);
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -511,7 +1056,9 @@ interrupt_handler (struct intr_frame *f)
   for (c = channels; c < channels + CHANNEL_CNT; c++)
     if (f->vec_no == c->irq)
       {
-        if (c->expecting_interrupt) 
+        if (c->active != NULL)
+          transfer_interrupt (c);
+        else if (c->expecting_interrupt) 
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
@@ -1,6 +1,14 @@
 #ifndef DEVICES_IDE_H
 #define DEVICES_IDE_H
 
+#include <stdbool.h>
+
+/* If false (default), transfer sectors by DMA where possible.
+   If true, always use PIO.
+   Controlled by kernel command-line option "-pio". */
+extern bool ide_pio_only;
+
 void ide_init (void);
+void ide_print_stats (void);
 
 #endif /* devices/ide.h */
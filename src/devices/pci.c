@@ -0,0 +1,84 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/interrupt.h"
+#include "threads/io.h"
+
+/* Access to PCI configuration space, by configuration mechanism
+   #1: the address of a 32-bit configuration register is written
+   to CONFIG_ADDRESS, and then the register is read or written
+   through CONFIG_DATA.  On a machine without PCI, reads return
+   all 1-bits, which look like an empty slot. */
+#define CONFIG_ADDRESS 0xcf8
+#define CONFIG_DATA 0xcfc
+
+/* Reads the 32-bit configuration register at byte offset REG,
+   which must be a multiple of 4, in function F. */
+uint32_t
+pci_read_config (const struct pci_func *f, int reg) 
+{
+  enum intr_level old_level;
+  uint32_t value;
+
+  ASSERT (reg % 4 == 0 && reg < 256);
+
+  old_level = intr_disable ();
+  outl (CONFIG_ADDRESS, (0x80000000 | (f->bus << 16) | (f->dev << 11)
+                         | (f->func << 8) | reg));
+  value = inl (CONFIG_DATA);
+  intr_set_level (old_level);
+  return value;
+}
+
+/* Writes VALUE to the 32-bit configuration register at byte
+   offset REG, which must be a multiple of 4, in function F. */
+void
+pci_write_config (const struct pci_func *f, int reg, uint32_t value) 
+{
+  enum intr_level old_level;
+
+  ASSERT (reg % 4 == 0 && reg < 256);
+
+  old_level = intr_disable ();
+  outl (CONFIG_ADDRESS, (0x80000000 | (f->bus << 16) | (f->dev << 11)
+                         | (f->func << 8) | reg));
+  outl (CONFIG_DATA, value);
+  intr_set_level (old_level);
+}
+
+/* Searches every PCI bus for the first function with the given
+   CLASS and SUBCLASS codes.  If one is found, stores its
+   location in *F and returns true; otherwise, returns false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_func *f) 
+{
+  int bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      for (func = 0; func < 8; func++) 
+        {
+          uint32_t class_reg;
+
+          f->bus = bus;
+          f->dev = dev;
+          f->func = func;
+          if ((pci_read_config (f, PCI_REG_ID) & 0xffff) == 0xffff) 
+            {
+              /* No function 0 means no device at all. */
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          class_reg = pci_read_config (f, PCI_REG_CLASS);
+          if ((class_reg >> 24) == class
+              && ((class_reg >> 16) & 0xff) == subclass)
+            return true;
+
+          /* Only a multifunction device has functions past 0. */
+          if (func == 0
+              && !(pci_read_config (f, PCI_REG_HEADER) & 0x00800000))
+            break;
+        }
+  return false;
+}
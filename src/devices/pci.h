@@ -0,0 +1,30 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Location of a PCI function. */
+struct pci_func
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t dev;                /* Device number on bus, 0...31. */
+    uint8_t func;               /* Function number in device, 0...7. */
+  };
+
+/* Configuration space registers, as byte offsets. */
+#define PCI_REG_ID 0x00         /* Device ID, vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Status, command. */
+#define PCI_REG_CLASS 0x08      /* Class, subclass, prog IF, revision. */
+#define PCI_REG_HEADER 0x0c     /* BIST, header type, latency, cache. */
+#define PCI_REG_BAR(N) (0x10 + 4 * (N)) /* Base address register N. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O port accesses. */
+#define PCI_CMD_MASTER 0x0004   /* Allow bus mastering. */
+
+uint32_t pci_read_config (const struct pci_func *, int reg);
+void pci_write_config (const struct pci_func *, int reg, uint32_t);
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_func *);
+
+#endif /* devices/pci.h */
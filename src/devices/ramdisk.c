@@ -0,0 +1,103 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* A block device whose sectors are kept in memory.
+
+   The RAM disk, named "ram0", is registered as a raw device, so
+   it is not used unless a role is assigned to it explicitly, as
+   in "-filesys=ram0", "-scratch=ram0" or "-swap=ram0".  It starts
+   out zeroed and its contents are lost at shutdown, so it suits
+   scratch data, and it gives a baseline for measuring file
+   system overhead apart from the cost of an emulated disk.
+
+   The sectors live in individually allocated pages, so that a
+   large RAM disk does not need physically contiguous memory. */
+
+/* Sectors per page. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+size_t ramdisk_kb;
+
+static uint8_t **pages;         /* Pages holding the sectors. */
+static struct lock ramdisk_lock; /* Makes transfers atomic. */
+
+static struct block_operations ramdisk_operations;
+
+/* Creates the RAM disk, if "-ramdisk" asked for one, and
+   registers it with the block device layer.  Panics if there is
+   not enough memory for it. */
+void
+ramdisk_init (void) 
+{
+  block_sector_t sector_cnt;
+  size_t page_cnt;
+  size_t i;
+
+  if (ramdisk_kb == 0)
+    return;
+
+  sector_cnt = ramdisk_kb * 1024 / BLOCK_SECTOR_SIZE;
+  page_cnt = DIV_ROUND_UP (sector_cnt, SECTORS_PER_PAGE);
+  pages = malloc (page_cnt * sizeof *pages);
+  if (pages == NULL)
+    PANIC ("ram0: out of memory");
+  for (i = 0; i < page_cnt; i++) 
+    {
+      pages[i] = palloc_get_page (PAL_ZERO);
+      if (pages[i] == NULL)
+        PANIC ("ram0: out of memory for %zu kB RAM disk", ramdisk_kb);
+    }
+  lock_init (&ramdisk_lock);
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk", sector_cnt,
+                  &ramdisk_operations, NULL);
+}
+
+/* Returns the address of SECTOR's data. */
+static uint8_t *
+sector_data (block_sector_t sector) 
+{
+  return (pages[sector / SECTORS_PER_PAGE]
+          + sector % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads the CNT sectors starting at SECTOR into BUFFER. */
+static void
+ramdisk_read (void *aux UNUSED, block_sector_t sector, void *buffer_,
+              size_t cnt) 
+{
+  uint8_t *buffer = buffer_;
+
+  lock_acquire (&ramdisk_lock);
+  for (; cnt > 0; cnt--, sector++, buffer += BLOCK_SECTOR_SIZE)
+    memcpy (buffer, sector_data (sector), BLOCK_SECTOR_SIZE);
+  lock_release (&ramdisk_lock);
+}
+
+/* Writes the CNT sectors starting at SECTOR from BUFFER. */
+static void
+ramdisk_write (void *aux UNUSED, block_sector_t sector,
+               const void *buffer_, size_t cnt) 
+{
+  const uint8_t *buffer = buffer_;
+
+  lock_acquire (&ramdisk_lock);
+  for (; cnt > 0; cnt--, sector++, buffer += BLOCK_SECTOR_SIZE)
+    memcpy (sector_data (sector), buffer, BLOCK_SECTOR_SIZE);
+  lock_release (&ramdisk_lock);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    NULL
+  };
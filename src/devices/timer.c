@@ -20,11 +20,19 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
+/* List of threads blocked in timer_sleep(), in ascending order
+   of wake-up tick.  Threads with equal wake-up ticks are kept in
+   the order in which they went to sleep.  Protected by disabling
+   interrupts, since timer_interrupt() removes threads from it. */
+static struct list sleep_list;
+
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
 static intr_handler_func timer_interrupt;
+static list_less_func wakeup_less;
+static void wake_sleepers (void);
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
@@ -36,6 +44,7 @@ void
 timer_init (void) 
 {
   pit_configure_channel (0, 2, TIMER_FREQ);
+  list_init (&sleep_list);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
@@ -85,15 +94,27 @@ timer_elapsed (int64_t then)
 }
 
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
-   be turned on. */
+   be turned on.
+
+   The running thread is blocked on sleep_list until
+   timer_interrupt() notices that its wake-up tick has arrived,
+   so a sleeping thread consumes no CPU time at all. */
 void
 timer_sleep (int64_t ticks) 
 {
   int64_t start = timer_ticks ();
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
 
   ASSERT (intr_get_level () == INTR_ON);
-  while (timer_elapsed (start) < ticks) 
-    thread_yield ();
+  if (ticks <= 0)
+    return;
+
+  old_level = intr_disable ();
+  cur->wakeup_tick = start + ticks;
+  list_insert_ordered (&sleep_list, &cur->elem, wakeup_less, NULL);
+  thread_block ();
+  intr_set_level (old_level);
 }
 
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
@@ -171,9 +192,45 @@ static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
   ticks++;
+  wake_sleepers ();
   thread_tick ();
 }
 
+/* Unblocks every thread on sleep_list whose wake-up tick has
+   arrived.  Because the list is sorted, the common case of no
+   thread being due costs a single comparison against the front
+   of the list.  If an awakened thread outranks the interrupted
+   one, the interrupted thread yields on return. */
+static void
+wake_sleepers (void) 
+{
+  bool woke = false;
+
+  while (!list_empty (&sleep_list)) 
+    {
+      struct thread *t = list_entry (list_front (&sleep_list),
+                                     struct thread, elem);
+      if (t->wakeup_tick > ticks)
+        break;
+      list_pop_front (&sleep_list);
+      thread_unblock (t);
+      woke = true;
+    }
+  if (woke)
+    thread_yield_to_higher ();
+}
+
+/* Returns true if thread A_ should wake up before thread B_. */
+static bool
+wakeup_less (const struct list_elem *a_, const struct list_elem *b_,
+             void *aux UNUSED) 
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+
+  return a->wakeup_tick < b->wakeup_tick;
+}
+
 /* Returns true if LOOPS iterations waits for more than one timer
    tick, otherwise false. */
 static bool
@@ -0,0 +1,682 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Buffer cache for the file system device.
+
+   Holds up to CACHE_SIZE sectors of fs_device in memory.  All
+   file system I/O -- inodes, file data, directories and the
+   free map -- goes through the cache, so sectors that are used
+   repeatedly are read from disk only once, and writes are
+   deferred until a sector is evicted or the cache is flushed.
+   Replacement uses the clock algorithm.
+
+   Synchronization is two-level.  cache_lock protects the
+   mapping from sectors to entries (`sector', `hash_elem'),
+   `pin_cnt', `accessed' and the clock hand.  Each entry's
+   `lock' protects its data and the `valid' and `dirty' members,
+   and is held across the disk I/O that fills or writes back the
+   entry, so threads using different sectors do not wait for each
+   other's I/O.  An entry is pinned (pin_cnt > 0) while any thread
+   uses or waits for it, and only unpinned entries are evicted.
+
+   A dirty sector that is evicted leaves cache_map before its data
+   reaches the disk.  Until then its entry's `writeback' member
+   names it, and a thread that wants the sector waits on
+   writeback_done instead of reading the old data from disk.
+   `writeback' is changed only with both cache_lock and the
+   entry's `lock' held, so either lock suffices to read it.
+
+   Dirty sectors are written behind by a kernel thread, the
+   flusher, so that writers only pay for a memory copy.  The
+   flusher writes back every dirty sector each FLUSH_PERIOD
+   ticks, and sooner if DIRTY_HIGH or more entries are dirty, so
+   that eviction usually finds clean entries and does not have to
+   wait for a write.  It does so through journal_commit(), which
+   commits the metadata changes made since its last pass.  Until
+   then, sectors that are part of the journal's running
+   transaction stay in the cache: they are neither evicted nor
+   written back.
+
+   Sectors that a reader is expected to need soon can be queued
+   with cache_readahead().  Another kernel thread reads them into
+   the cache in the background, so a sequential reader finds its
+   next sectors already in memory.  Runs of consecutive sectors,
+   whether queued for read-ahead or passed to cache_fill(), are
+   read from disk with a single multi-sector request. */
+
+/* Number of sectors in the cache. */
+#define CACHE_SIZE 64
+
+/* No sector. */
+#define NO_SECTOR ((block_sector_t) -1)
+
+/* Write-behind. */
+#define FLUSH_PERIOD (5 * TIMER_FREQ)   /* Ticks between flushes. */
+#define DIRTY_HIGH (CACHE_SIZE * 3 / 4) /* Dirty entries that force a flush. */
+
+/* Write-backs that cache_flush() submits before waiting for
+   them, so that the disk driver can sort and merge them. */
+#define FLUSH_BATCH 16
+static struct block_request flush_reqs[FLUSH_BATCH];
+static struct cache_entry *flush_entries[FLUSH_BATCH];
+static struct lock flush_lock;          /* Protects the arrays above. */
+
+/* Read-ahead queue, a circular buffer of sectors to prefetch. */
+#define RA_QUEUE_SIZE 32                /* Max sectors queued at once. */
+static block_sector_t ra_queue[RA_QUEUE_SIZE];
+static size_t ra_head, ra_cnt;          /* First sector, # of sectors. */
+static struct lock ra_lock;             /* Protects the queue. */
+static struct condition ra_nonempty;    /* Signaled when queue gains one. */
+
+/* A cached sector. */
+struct cache_entry 
+  {
+    /* Protected by cache_lock. */
+    struct hash_elem hash_elem;         /* Element in cache_map. */
+    block_sector_t sector;              /* Sector cached, or NO_SECTOR. */
+    int pin_cnt;                        /* Number of users. */
+    bool accessed;                      /* Used since clock hand passed? */
+
+    /* Protected by `lock'. */
+    struct lock lock;                   /* Protects data. */
+    bool valid;                         /* Does data hold sector's bytes? */
+    bool dirty;                         /* Does data differ from disk? */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+
+    /* Changed with both cache_lock and `lock' held. */
+    block_sector_t writeback;           /* Evicted sector to write back. */
+  };
+
+static struct cache_entry entries[CACHE_SIZE];
+static struct hash cache_map;           /* Maps sectors to entries. */
+static struct lock cache_lock;          /* Protects mapping, pins. */
+static size_t clock_hand;               /* Next eviction candidate. */
+static int dirty_cnt;                   /* Number of dirty entries. */
+static int writeback_pending;           /* Entries with `writeback' set. */
+static struct condition writeback_done; /* Signaled when one finishes. */
+static bool flush_requested;            /* Should the flusher run? */
+static struct condition flush_needed;   /* Signaled when it should. */
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups found in cache. */
+static unsigned long long miss_cnt;     /* Lookups that went to disk. */
+static unsigned long long writeback_cnt; /* Dirty sectors written. */
+static unsigned long long flush_cnt;    /* Flusher passes. */
+static unsigned long long readahead_cnt; /* Sectors prefetched. */
+
+static hash_hash_func entry_hash;
+static hash_less_func entry_less;
+static struct cache_entry *lookup (block_sector_t);
+static bool writing_back (block_sector_t);
+static struct cache_entry *choose_victim (void);
+static struct cache_entry *claim (block_sector_t);
+static void write_back (struct cache_entry *);
+static void finish_flush (size_t cnt);
+static struct cache_entry *cache_get (block_sector_t, bool load);
+static void cache_put (struct cache_entry *);
+static void adjust_dirty_cnt (int delta);
+static void request_flush (void);
+static thread_func flusher;
+static thread_func flush_timer;
+static thread_func read_ahead;
+
+/* Initializes the buffer cache. */
+void
+cache_init (void) 
+{
+  uint8_t *data;
+  size_t i;
+
+  lock_init (&cache_lock);
+  if (!hash_init (&cache_map, entry_hash, entry_less, NULL))
+    PANIC ("buffer cache hash table creation failed");
+
+  data = palloc_get_multiple (PAL_ASSERT,
+                              CACHE_SIZE * BLOCK_SECTOR_SIZE / PGSIZE);
+  for (i = 0; i < CACHE_SIZE; i++) 
+    {
+      struct cache_entry *e = &entries[i];
+      e->sector = NO_SECTOR;
+      e->pin_cnt = 0;
+      e->accessed = false;
+      lock_init (&e->lock);
+      e->valid = false;
+      e->dirty = false;
+      e->writeback = NO_SECTOR;
+      e->data = data + i * BLOCK_SECTOR_SIZE;
+    }
+  clock_hand = 0;
+  dirty_cnt = 0;
+  writeback_pending = 0;
+  cond_init (&writeback_done);
+  flush_requested = false;
+  cond_init (&flush_needed);
+
+  lock_init (&flush_lock);
+  thread_create ("flusher", PRI_DEFAULT, flusher, NULL);
+  thread_create ("flush-timer", PRI_DEFAULT, flush_timer, NULL);
+
+  lock_init (&ra_lock);
+  cond_init (&ra_nonempty);
+  ra_head = ra_cnt = 0;
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead, NULL);
+}
+
+/* Reads SECTOR from the file system device into BUFFER, which
+   must have room for BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer) 
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes BUFFER, which must contain BLOCK_SECTOR_SIZE bytes, to
+   SECTOR on the file system device.  The data reaches the disk
+   when the flusher next runs, or at the latest at the next
+   cache_flush(). */
+void
+cache_write (block_sector_t sector, const void *buffer) 
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within SECTOR of
+   the file system device into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, int ofs, int size) 
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR of the file system
+   device, starting at byte offset OFS within the sector.  A
+   write that covers the whole sector does not need to read the
+   sector's old contents from disk. */
+void
+cache_write_at (block_sector_t sector, const void *buffer, int ofs, int size) 
+{
+  struct cache_entry *e;
+  bool was_dirty;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->valid = true;
+  was_dirty = e->dirty;
+  e->dirty = true;
+  cache_put (e);
+
+  if (!was_dirty)
+    adjust_dirty_cnt (1);
+}
+
+/* Asks for SECTOR to be read into the cache in the background.
+   The request is dropped if the read-ahead queue is full, since
+   read-ahead is only a hint. */
+void
+cache_readahead (block_sector_t sector) 
+{
+  lock_acquire (&ra_lock);
+  if (ra_cnt < RA_QUEUE_SIZE) 
+    {
+      ra_queue[(ra_head + ra_cnt++) % RA_QUEUE_SIZE] = sector;
+      cond_signal (&ra_nonempty, &ra_lock);
+    }
+  lock_release (&ra_lock);
+}
+
+/* Reads those of the CNT sectors starting at SECTOR that are not
+   already cached into the cache, reading each run of consecutive
+   missing sectors from disk with one request.  Like read-ahead,
+   this is only a hint: it stops early if no entry can be
+   evicted.  Returns the number of sectors read. */
+size_t
+cache_fill (block_sector_t sector, size_t cnt) 
+{
+  struct cache_entry *run[CACHE_FILL_MAX];
+  block_sector_t end = sector + cnt;
+  size_t read_cnt = 0;
+
+  ASSERT (cnt <= CACHE_FILL_MAX);
+
+  while (sector < end) 
+    {
+      size_t run_cnt = 0;
+      uint8_t *buffer;
+      size_t i;
+
+      /* Skip sectors already cached or still being written
+         back, then claim entries for the missing ones that
+         follow. */
+      lock_acquire (&cache_lock);
+      while (sector < end
+             && (lookup (sector) != NULL || writing_back (sector)))
+        sector++;
+      while (sector + run_cnt < end
+             && lookup (sector + run_cnt) == NULL
+             && !writing_back (sector + run_cnt)) 
+        {
+          struct cache_entry *e = claim (sector + run_cnt);
+          if (e == NULL)
+            break;
+          run[run_cnt++] = e;
+        }
+      lock_release (&cache_lock);
+      if (run_cnt == 0)
+        break;
+
+      for (i = 0; i < run_cnt; i++)
+        write_back (run[i]);
+
+      /* The entries' data are not adjacent in memory, so read
+         through a bounce buffer, or a sector at a time if there
+         is no memory for one. */
+      buffer = malloc (run_cnt * BLOCK_SECTOR_SIZE);
+      if (buffer != NULL)
+        block_read_multiple (fs_device, sector, buffer, run_cnt);
+      for (i = 0; i < run_cnt; i++) 
+        {
+          struct cache_entry *e = run[i];
+          if (buffer != NULL)
+            memcpy (e->data, buffer + i * BLOCK_SECTOR_SIZE,
+                    BLOCK_SECTOR_SIZE);
+          else
+            block_read (fs_device, sector + i, e->data);
+          e->valid = true;
+          cache_put (e);
+        }
+      free (buffer);
+
+      sector += run_cnt;
+      read_cnt += run_cnt;
+    }
+  return read_cnt;
+}
+
+/* Writes every dirty sector in the cache to disk, except those
+   that the journal holds.  Submits the writes in batches of up
+   to FLUSH_BATCH, holding the entries until each batch is
+   done. */
+void
+cache_flush (void) 
+{
+  size_t cnt = 0;
+  size_t i;
+
+  lock_acquire (&flush_lock);
+  for (i = 0; i < CACHE_SIZE; i++) 
+    {
+      struct cache_entry *e = &entries[i];
+
+      lock_acquire (&cache_lock);
+      if (e->sector == NO_SECTOR) 
+        {
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->pin_cnt++;
+      lock_release (&cache_lock);
+
+      lock_acquire (&e->lock);
+      if (e->valid && e->dirty && !journal_holds (e->sector)) 
+        {
+          block_request_init (&flush_reqs[cnt], e->sector, e->data, 1,
+                              true);
+          block_submit (fs_device, &flush_reqs[cnt]);
+          flush_entries[cnt++] = e;
+          if (cnt == FLUSH_BATCH) 
+            {
+              finish_flush (cnt);
+              cnt = 0;
+            }
+        }
+      else
+        cache_put (e);
+    }
+  finish_flush (cnt);
+  lock_release (&flush_lock);
+}
+
+/* Waits for the first CNT write-backs submitted by cache_flush()
+   and releases their entries, which are now clean. */
+static void
+finish_flush (size_t cnt) 
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++) 
+    {
+      struct cache_entry *e = flush_entries[i];
+
+      block_wait (&flush_reqs[i]);
+      e->dirty = false;
+      lock_acquire (&cache_lock);
+      writeback_cnt++;
+      lock_release (&cache_lock);
+      cache_put (e);
+      adjust_dirty_cnt (-1);
+    }
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void) 
+{
+  printf ("Cache: %llu hits, %llu misses, %llu write-backs, "
+          "%llu flusher passes, %llu sectors read ahead\n",
+          hit_cnt, miss_cnt, writeback_cnt, flush_cnt, readahead_cnt);
+}
+
+/* Read-ahead thread.  Reads each sector queued by
+   cache_readahead() into the cache, unless it is already there.
+   Takes consecutive sectors off the queue together, up to
+   CACHE_FILL_MAX of them, so that they are read with a single
+   request. */
+static void
+read_ahead (void *aux UNUSED) 
+{
+  for (;;) 
+    {
+      block_sector_t sector;
+      size_t cnt;
+
+      lock_acquire (&ra_lock);
+      while (ra_cnt == 0)
+        cond_wait (&ra_nonempty, &ra_lock);
+      sector = ra_queue[ra_head];
+      cnt = 0;
+      do 
+        {
+          ra_head = (ra_head + 1) % RA_QUEUE_SIZE;
+          ra_cnt--;
+          cnt++;
+        }
+      while (ra_cnt > 0 && cnt < CACHE_FILL_MAX
+             && ra_queue[ra_head] == sector + cnt);
+      lock_release (&ra_lock);
+
+      readahead_cnt += cache_fill (sector, cnt);
+    }
+}
+
+/* Flusher thread.  Writes dirty sectors back to disk whenever
+   request_flush() asks it to: every FLUSH_PERIOD ticks, and
+   sooner when adjust_dirty_cnt() finds that too many entries are
+   dirty.  Each pass first brings the free map file up to date,
+   so that free map changes are written in batches. */
+static void
+flusher (void *aux UNUSED) 
+{
+  for (;;) 
+    {
+      lock_acquire (&cache_lock);
+      while (!flush_requested)
+        cond_wait (&flush_needed, &cache_lock);
+      flush_requested = false;
+      lock_release (&cache_lock);
+
+      journal_commit ();
+      flush_cnt++;
+    }
+}
+
+/* Flush timer thread.  Wakes the flusher every FLUSH_PERIOD
+   ticks. */
+static void
+flush_timer (void *aux UNUSED) 
+{
+  for (;;) 
+    {
+      timer_sleep (FLUSH_PERIOD);
+      lock_acquire (&cache_lock);
+      request_flush ();
+      lock_release (&cache_lock);
+    }
+}
+
+/* Adds DELTA to the count of dirty entries, asking the flusher
+   to run early if the count has reached DIRTY_HIGH. */
+static void
+adjust_dirty_cnt (int delta) 
+{
+  lock_acquire (&cache_lock);
+  dirty_cnt += delta;
+  if (dirty_cnt >= DIRTY_HIGH)
+    request_flush ();
+  lock_release (&cache_lock);
+}
+
+/* Wakes the flusher, unless it has already been asked to run.
+   cache_lock must be held. */
+static void
+request_flush (void) 
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  if (!flush_requested) 
+    {
+      flush_requested = true;
+      cond_signal (&flush_needed, &cache_lock);
+    }
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held.
+   If SECTOR is not cached, evicts another sector to make room.
+   If LOAD is true, the entry's data is read from disk if it is
+   not already valid; otherwise the caller must overwrite all of
+   it. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load) 
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  for (;;) 
+    {
+      e = lookup (sector);
+      if (e != NULL) 
+        {
+          e->pin_cnt++;
+          e->accessed = true;
+          hit_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          break;
+        }
+
+      /* SECTOR's newest data may still be on its way to disk
+         from an entry that evicted it. */
+      if (writing_back (sector)) 
+        {
+          cond_wait (&writeback_done, &cache_lock);
+          continue;
+        }
+
+      e = claim (sector);
+      if (e != NULL) 
+        {
+          lock_release (&cache_lock);
+          break;
+        }
+
+      /* Every entry is in use.  Let their users finish. */
+      lock_release (&cache_lock);
+      thread_yield ();
+      lock_acquire (&cache_lock);
+    }
+
+  write_back (e);
+  if (load && !e->valid) 
+    {
+      block_read (fs_device, sector, e->data);
+      e->valid = true;
+    }
+  return e;
+}
+
+/* Evicts an unpinned entry and assigns it to SECTOR, which must
+   be neither cached nor being written back.  Returns the entry,
+   pinned, with its lock held and its data not valid; the caller
+   must call write_back() on it before using the data.  Returns a
+   null pointer if every entry is pinned.  cache_lock must be
+   held. */
+static struct cache_entry *
+claim (block_sector_t sector) 
+{
+  struct cache_entry *e;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  e = choose_victim ();
+  if (e == NULL)
+    return NULL;
+
+  /* Nobody holds an unpinned entry's lock, so this does not
+     block.  Taking it before dropping cache_lock ensures that we
+     write back the old sector before anyone can use the entry
+     for the new one. */
+  lock_acquire (&e->lock);
+  if (e->sector != NO_SECTOR) 
+    {
+      hash_delete (&cache_map, &e->hash_elem);
+      if (e->valid && e->dirty) 
+        {
+          e->writeback = e->sector;
+          writeback_pending++;
+          dirty_cnt--;
+        }
+    }
+  e->sector = sector;
+  e->pin_cnt = 1;
+  e->accessed = true;
+  e->valid = false;
+  e->dirty = false;
+  hash_insert (&cache_map, &e->hash_elem);
+  miss_cnt++;
+  return e;
+}
+
+/* Writes the sector that entry E held before claim() reassigned
+   it back to disk, if it was dirty, and wakes any thread waiting
+   to use that sector.  E's lock must be held. */
+static void
+write_back (struct cache_entry *e) 
+{
+  if (e->writeback != NO_SECTOR) 
+    {
+      block_write (fs_device, e->writeback, e->data);
+
+      lock_acquire (&cache_lock);
+      e->writeback = NO_SECTOR;
+      writeback_pending--;
+      writeback_cnt++;
+      cond_broadcast (&writeback_done, &cache_lock);
+      lock_release (&cache_lock);
+    }
+}
+
+/* Releases entry E, which was obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e) 
+{
+  lock_release (&e->lock);
+
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  e->pin_cnt--;
+  lock_release (&cache_lock);
+}
+
+/* Returns the entry that caches SECTOR, or a null pointer if
+   there is none.  cache_lock must be held. */
+static struct cache_entry *
+lookup (block_sector_t sector) 
+{
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  key.sector = sector;
+  e = hash_find (&cache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
+}
+
+/* Returns true if SECTOR was evicted from the cache but its data
+   has not yet been written back to disk.  cache_lock must be
+   held. */
+static bool
+writing_back (block_sector_t sector) 
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  if (writeback_pending > 0)
+    for (i = 0; i < CACHE_SIZE; i++)
+      if (entries[i].writeback == sector)
+        return true;
+  return false;
+}
+
+/* Chooses an unpinned entry to evict using the clock algorithm,
+   giving entries used since the hand last passed them a second
+   chance.  Returns a null pointer if every entry is pinned.
+   cache_lock must be held. */
+static struct cache_entry *
+choose_victim (void) 
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  /* Two full sweeps are enough: the first clears every
+     `accessed' bit that is set. */
+  for (i = 0; i < 2 * CACHE_SIZE; i++) 
+    {
+      struct cache_entry *e = &entries[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+      if (e->pin_cnt > 0 || journal_holds (e->sector))
+        continue;
+      if (e->accessed && e->sector != NO_SECTOR)
+        e->accessed = false;
+      else
+        return e;
+    }
+  return NULL;
+}
+
+/* Returns a hash value for cache entry E. */
+static unsigned
+entry_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  return hash_int (hash_entry (e, struct cache_entry, hash_elem)->sector);
+}
+
+/* Returns true if cache entry A precedes cache entry B. */
+static bool
+entry_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED) 
+{
+  return (hash_entry (a, struct cache_entry, hash_elem)->sector
+          < hash_entry (b, struct cache_entry, hash_elem)->sector);
+}
@@ -0,0 +1,20 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Most sectors that cache_fill() reads with one request. */
+#define CACHE_FILL_MAX 8
+
+void cache_init (void);
+void cache_read (block_sector_t, void *);
+void cache_write (block_sector_t, const void *);
+void cache_read_at (block_sector_t, void *, int ofs, int size);
+void cache_write_at (block_sector_t, const void *, int ofs, int size);
+void cache_readahead (block_sector_t);
+size_t cache_fill (block_sector_t, size_t cnt);
+void cache_flush (void);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
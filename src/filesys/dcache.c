@@ -0,0 +1,196 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* Directory entry cache.
+
+   Remembers the results of recent name lookups: for a directory,
+   identified by its inode sector, and a name, either the inode
+   sector the name refers to or, as a "negative" entry, the fact
+   that the directory has no such name.  Path lookups that hit in
+   the cache read no directory blocks at all.
+
+   directory.c consults the cache in dir_lookup() and updates it
+   in dir_add() and dir_remove(), which are the only ways a
+   directory's contents change.  When a directory is deallocated,
+   inode.c purges the entries for it, since its sector may next
+   hold a different directory.  So the cache never holds stale
+   results.  It holds up to DCACHE_SIZE entries and replaces the
+   least recently used one to make room. */
+
+/* Number of cached lookups. */
+#define DCACHE_SIZE 256
+
+/* A cached lookup. */
+struct dentry 
+  {
+    struct hash_elem hash_elem;         /* Element in dentry_map. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    bool valid;                         /* In dentry_map? */
+    block_sector_t dir;                 /* Directory inode sector. */
+    char name[NAME_MAX + 1];            /* Name looked up in DIR. */
+    block_sector_t sector;              /* Result, or DCACHE_NEGATIVE. */
+  };
+
+static struct dentry dentries[DCACHE_SIZE];
+static struct hash dentry_map;      /* Valid entries by dir and name. */
+static struct list lru_list;        /* All entries, most recent first. */
+static struct lock dcache_lock;     /* Protects all of the above. */
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups found in cache. */
+static unsigned long long miss_cnt;     /* Lookups not found. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *find (block_sector_t dir, const char *name);
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void) 
+{
+  size_t i;
+
+  if (!hash_init (&dentry_map, dentry_hash, dentry_less, NULL))
+    PANIC ("can't create directory entry cache");
+  list_init (&lru_list);
+  lock_init (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++) 
+    {
+      dentries[i].valid = false;
+      list_push_back (&lru_list, &dentries[i].lru_elem);
+    }
+}
+
+/* Looks up NAME in directory DIR in the cache.  If found,
+   returns true and stores into *SECTORP the sector of the inode
+   NAME refers to, or DCACHE_NEGATIVE if DIR has no entry for
+   NAME.  Otherwise, returns false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name,
+               block_sector_t *sectorp) 
+{
+  struct dentry *e;
+
+  lock_acquire (&dcache_lock);
+  e = find (dir, name);
+  if (e != NULL) 
+    {
+      list_remove (&e->lru_elem);
+      list_push_front (&lru_list, &e->lru_elem);
+      *sectorp = e->sector;
+      hit_cnt++;
+    }
+  else
+    miss_cnt++;
+  lock_release (&dcache_lock);
+
+  return e != NULL;
+}
+
+/* Records that NAME in directory DIR refers to the inode in
+   SECTOR, or that there is no such name if SECTOR is
+   DCACHE_NEGATIVE.  Names longer than NAME_MAX are not
+   cached. */
+void
+dcache_insert (block_sector_t dir, const char *name,
+               block_sector_t sector) 
+{
+  struct dentry *e;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  e = find (dir, name);
+  if (e == NULL) 
+    {
+      /* Reuse the least recently used entry. */
+      e = list_entry (list_back (&lru_list), struct dentry, lru_elem);
+      if (e->valid)
+        hash_delete (&dentry_map, &e->hash_elem);
+      e->dir = dir;
+      strlcpy (e->name, name, sizeof e->name);
+      e->valid = true;
+      hash_insert (&dentry_map, &e->hash_elem);
+    }
+  e->sector = sector;
+  list_remove (&e->lru_elem);
+  list_push_front (&lru_list, &e->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every cached lookup in directory DIR. */
+void
+dcache_purge (block_sector_t dir) 
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++) 
+    {
+      struct dentry *e = &dentries[i];
+      if (e->valid && e->dir == dir) 
+        {
+          hash_delete (&dentry_map, &e->hash_elem);
+          e->valid = false;
+          list_remove (&e->lru_elem);
+          list_push_back (&lru_list, &e->lru_elem);
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints directory entry cache statistics. */
+void
+dcache_print_stats (void) 
+{
+  unsigned long long lookup_cnt = hit_cnt + miss_cnt;
+
+  printf ("Dentry cache: %llu hits, %llu misses, %llu%% hit rate\n",
+          hit_cnt, miss_cnt,
+          lookup_cnt > 0 ? hit_cnt * 100 / lookup_cnt : 0);
+}
+
+/* Returns the valid entry for NAME in DIR, or a null pointer if
+   there is none.  dcache_lock must be held. */
+static struct dentry *
+find (block_sector_t dir, const char *name) 
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&dcache_lock));
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentry_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Returns a hash of dentry E's directory and name. */
+static unsigned
+dentry_hash (const struct hash_elem *e_, void *aux UNUSED) 
+{
+  const struct dentry *e = hash_entry (e_, struct dentry, hash_elem);
+  return hash_string (e->name) ^ hash_int (e->dir);
+}
+
+/* Orders dentries A and B by directory, then by name. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED) 
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
@@ -1,9 +1,12 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
 /* A directory. */
@@ -21,21 +24,201 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* On-disk directory layout.
+
+   A directory's file is an array of sector-sized blocks.  Block
+   0 is a header.  The other blocks are buckets of a hash table
+   keyed on entry name: primary bucket B is block 1 + B, and the
+   overflow buckets chained from full buckets are blocks
+   OVERFLOW_BASE and up.  Looking up a name reads the header and,
+   unless its bucket has overflowed, one bucket, no matter how
+   large the directory is.  An overflow bucket that becomes empty
+   is unlinked from its chain, and the last overflow bucket moves
+   into its block, so that the overflow blocks in use stay
+   contiguous and are reused.
+
+   The table uses linear hashing.  It starts small and gains one
+   bucket at a time: whenever an insertion raises the average
+   load above SPLIT_LOAD entries per bucket, bucket `split' is
+   split by rehashing its entries with one more bit of the hash
+   into a new bucket at the end of the table.  No insertion does
+   more than one bucket chain's worth of work, and buckets not
+   yet in use are holes in the file that take no disk space. */
+
+/* Identifies a directory header. */
+#define DIR_MAGIC 0x44495248
+
+#define BUCKET_ENTRIES 25                  /* Entries per bucket. */
+#define SPLIT_LOAD (BUCKET_ENTRIES * 3 / 4) /* Average load that splits. */
+#define MAX_BUCKETS 4096                   /* Most primary buckets. */
+#define OVERFLOW_BASE (1 + MAX_BUCKETS)    /* First overflow block. */
+
+/* Directory header, at the start of block 0. */
+struct dir_header 
+  {
+    unsigned magic;                     /* Magic number. */
+    uint32_t level;                     /* 2**level <= buckets < 2**(level+1). */
+    uint32_t split;                     /* Next bucket to split. */
+    uint32_t entry_cnt;                 /* Number of entries in use. */
+    uint32_t overflow_cnt;              /* Number of overflow buckets. */
+    block_sector_t parent;              /* Parent directory's inode. */
+  };
+
+/* A bucket.  Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_bucket 
+  {
+    struct dir_entry entries[BUCKET_ENTRIES];
+    uint32_t next;                      /* Overflow block, or 0 if none. */
+    uint8_t unused[8];                  /* Not used. */
+  };
+
+/* Returns the byte offset of block BLOCK in a directory. */
+static inline off_t
+block_ofs (uint32_t block) 
+{
+  return (off_t) block * BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the number of primary buckets in the table described
+   by H. */
+static inline uint32_t
+bucket_cnt (const struct dir_header *h) 
+{
+  return (1u << h->level) + h->split;
+}
+
+/* Returns the primary bucket for NAME in the table described by
+   H. */
+static uint32_t
+bucket_of (const struct dir_header *h, const char *name) 
+{
+  unsigned hash = hash_string (name);
+  uint32_t bucket = hash & ((1u << h->level) - 1);
+  if (bucket < h->split)
+    bucket = hash & ((2u << h->level) - 1);
+  return bucket;
+}
+
+/* Reads DIR_INODE's header into *H.  Returns true if successful,
+   false on failure. */
+static bool
+read_header (struct inode *dir_inode, struct dir_header *h) 
+{
+  if (inode_read_at (dir_inode, h, sizeof *h, 0) != sizeof *h)
+    return false;
+  ASSERT (h->magic == DIR_MAGIC);
+  return true;
+}
+
+/* Writes *H as DIR_INODE's header.  Returns true if successful,
+   false on failure. */
+static bool
+write_header (struct inode *dir_inode, const struct dir_header *h) 
+{
+  return inode_write_at (dir_inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Reads block BLOCK of DIR_INODE into *B.  Any part of the block
+   past end of file reads as zeros, so a block that was never
+   written reads as an empty bucket. */
+static void
+read_bucket (struct inode *dir_inode, uint32_t block, struct dir_bucket *b) 
+{
+  off_t size = inode_read_at (dir_inode, b, sizeof *b, block_ofs (block));
+  memset ((uint8_t *) b + size, 0, sizeof *b - size);
+}
+
+/* Returns the block that follows block BLOCK of DIR_INODE in its
+   bucket chain, or 0 if BLOCK is the last one. */
+static uint32_t
+read_next (struct inode *dir_inode, uint32_t block) 
+{
+  uint32_t next;
+
+  if (inode_read_at (dir_inode, &next, sizeof next,
+                     block_ofs (block) + offsetof (struct dir_bucket, next))
+      != sizeof next)
+    next = 0;
+  return next;
+}
+
+/* Links block NEXT after block BLOCK of DIR_INODE in its bucket
+   chain.  Returns true if successful, false on failure. */
+static bool
+write_next (struct inode *dir_inode, uint32_t block, uint32_t next) 
+{
+  return (inode_write_at (dir_inode, &next, sizeof next,
+                          block_ofs (block) + offsetof (struct dir_bucket,
+                                                        next))
+          == sizeof next);
+}
+
+/* Returns true if bucket B has no entries in use. */
+static bool
+bucket_is_empty (const struct dir_bucket *b) 
+{
+  size_t i;
+
+  for (i = 0; i < BUCKET_ENTRIES; i++)
+    if (b->entries[i].in_use)
+      return false;
+  return true;
+}
+
+static bool readdir (struct dir *, char name[NAME_MAX + 1]);
+
+/* Returns true if the directory in DIR_INODE has no entries,
+   false otherwise. */
+static bool
+is_empty (struct inode *dir_inode) 
+{
+  struct dir_header h;
+
+  return read_header (dir_inode, &h) && h.entry_cnt == 0;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+   given SECTOR, as a subdirectory of the directory whose inode
+   is in PARENT.  Returns true if successful, false on failure. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector, block_sector_t parent, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir_header h;
+  struct inode *inode;
+  bool success;
+
+  /* If this assertion fails, the bucket structure is not exactly
+     one sector in size, and you should fix that. */
+  ASSERT (sizeof (struct dir_bucket) == BLOCK_SECTOR_SIZE);
+
+  if (!inode_create (sector, 0, true))
+    return false;
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+
+  h.magic = DIR_MAGIC;
+  h.level = 0;
+  while ((1u << h.level) * SPLIT_LOAD < entry_cnt
+         && (2u << h.level) <= MAX_BUCKETS)
+    h.level++;
+  h.split = 0;
+  h.entry_cnt = 0;
+  h.overflow_cnt = 0;
+  h.parent = parent;
+  success = write_header (inode, &h);
+  inode_close (inode);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
-   it takes ownership.  Returns a null pointer on failure. */
+   it takes ownership.  Returns a null pointer on failure, or if
+   INODE is not a directory. */
 struct dir *
 dir_open (struct inode *inode) 
 {
   struct dir *dir = calloc (1, sizeof *dir);
-  if (inode != NULL && dir != NULL)
+  if (inode != NULL && dir != NULL && inode_is_dir (inode))
     {
       dir->inode = inode;
       dir->pos = 0;
@@ -92,46 +275,261 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_header h;
+  struct dir_bucket b;
+  uint32_t block;
+  bool found = false;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
+  if (!read_header (dir->inode, &h))
+    return false;
+
+  for (block = 1 + bucket_of (&h, name); !found && block != 0;
+       block = b.next) 
+    {
+      size_t i;
+
+      read_bucket (dir->inode, block, &b);
+      for (i = 0; i < BUCKET_ENTRIES; i++) 
+        {
+          struct dir_entry *e = &b.entries[i];
+          if (e->in_use && !strcmp (name, e->name)) 
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = block_ofs (block) + i * sizeof *e;
+              found = true;
+              break;
+            }
+        }
+    }
+  return found;
+}
+
+/* Stores E in a free slot in the chain of buckets for primary
+   bucket BUCKET of DIR_INODE, whose header is H, adding an
+   overflow bucket to the chain if every slot is full.  Uses B
+   as scratch space.  Returns true if successful, false on
+   failure. */
+static bool
+insert_entry (struct inode *dir_inode, struct dir_header *h,
+              uint32_t bucket, const struct dir_entry *e,
+              struct dir_bucket *b) 
+{
+  uint32_t block = 1 + bucket;
+  uint32_t next;
+
+  for (;;) 
+    {
+      size_t i;
+
+      read_bucket (dir_inode, block, b);
+      for (i = 0; i < BUCKET_ENTRIES; i++)
+        if (!b->entries[i].in_use)
+          return (inode_write_at (dir_inode, e, sizeof *e,
+                                  block_ofs (block) + i * sizeof *e)
+                  == sizeof *e);
+      if (b->next == 0)
+        break;
+      block = b->next;
+    }
+
+  /* Chain is full.  Link in a new overflow bucket with E in its
+     first slot.  The block may have held an overflow bucket that
+     was since reclaimed, so write all of it. */
+  next = OVERFLOW_BASE + h->overflow_cnt;
+  memset (b, 0, sizeof *b);
+  b->entries[0] = *e;
+  if (inode_write_at (dir_inode, b, sizeof *b, block_ofs (next)) != sizeof *b
+      || !write_next (dir_inode, block, next))
+    return false;
+  h->overflow_cnt++;
+  return true;
+}
+
+/* Moves the last overflow bucket of DIR_INODE, whose header is H,
+   into block FREE_BLOCK, an overflow bucket that has been
+   unlinked from its chain, and relinks it there.  BUCKET is the
+   primary bucket whose chain FREE_BLOCK was in.  Uses B as
+   scratch space.  The caller must write back H.  Returns true if
+   successful, false on failure, in which case H is unchanged and
+   FREE_BLOCK is left as an empty bucket. */
+static bool
+move_last_overflow (struct inode *dir_inode, struct dir_header *h,
+                    uint32_t bucket, uint32_t free_block,
+                    struct dir_bucket *b) 
+{
+  uint32_t last = OVERFLOW_BASE + h->overflow_cnt - 1;
+  uint32_t prev, next;
+  size_t i;
+
+  if (free_block == last) 
+    {
+      h->overflow_cnt--;
+      return true;
+    }
+
+  /* Find the block that links to LAST.  Every entry is in the
+     chain of the bucket it hashes to.  A bucket with no entries
+     can only be an empty one in BUCKET's chain that is waiting
+     to be unlinked. */
+  read_bucket (dir_inode, last, b);
+  for (i = 0; i < BUCKET_ENTRIES; i++)
+    if (b->entries[i].in_use) 
       {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
+        bucket = bucket_of (h, b->entries[i].name);
+        break;
       }
-  return false;
+  for (prev = 1 + bucket; (next = read_next (dir_inode, prev)) != last;
+       prev = next)
+    if (next == 0)
+      return false;
+
+  if (inode_write_at (dir_inode, b, sizeof *b, block_ofs (free_block))
+      != sizeof *b
+      || !write_next (dir_inode, prev, free_block))
+    return false;
+  h->overflow_cnt--;
+  return true;
+}
+
+/* Unlinks and reclaims the empty overflow buckets in the chain of
+   primary bucket BUCKET of DIR_INODE, whose header is H.  Uses B
+   as scratch space.  The caller must write back H, even on
+   failure, since H reflects the buckets already reclaimed.
+   Returns true if successful, false on failure. */
+static bool
+reclaim_overflow (struct inode *dir_inode, struct dir_header *h,
+                  uint32_t bucket, struct dir_bucket *b) 
+{
+  uint32_t prev = 1 + bucket;
+  uint32_t block = read_next (dir_inode, prev);
+
+  while (block != 0) 
+    {
+      uint32_t last = OVERFLOW_BASE + h->overflow_cnt - 1;
+
+      read_bucket (dir_inode, block, b);
+      if (!bucket_is_empty (b)) 
+        {
+          prev = block;
+          block = b->next;
+          continue;
+        }
+
+      if (!write_next (dir_inode, prev, b->next)
+          || !move_last_overflow (dir_inode, h, bucket, block, b))
+        return false;
+      if (prev == last)
+        prev = block;
+      block = read_next (dir_inode, prev);
+    }
+  return true;
+}
+
+/* Adds one bucket to the hash table in DIR_INODE, whose header
+   is H, by moving the entries in bucket H->split that now hash
+   to the new bucket, then reclaims any overflow buckets that
+   this empties.  Uses SCRATCH as scratch space.  The caller must
+   write back H. */
+static bool
+split_bucket (struct inode *dir_inode, struct dir_header *h,
+              struct dir_bucket *scratch) 
+{
+  uint32_t old_bucket = h->split;
+  struct dir_bucket b;
+  uint32_t block;
+  bool success = true;
+
+  if (bucket_cnt (h) >= MAX_BUCKETS)
+    return true;
+
+  if (++h->split == 1u << h->level) 
+    {
+      h->level++;
+      h->split = 0;
+    }
+
+  for (block = 1 + old_bucket; success && block != 0; block = b.next) 
+    {
+      size_t i;
+
+      read_bucket (dir_inode, block, &b);
+      for (i = 0; success && i < BUCKET_ENTRIES; i++) 
+        {
+          struct dir_entry *e = &b.entries[i];
+          uint32_t new_bucket;
+
+          if (!e->in_use)
+            continue;
+          new_bucket = bucket_of (h, e->name);
+          if (new_bucket == old_bucket)
+            continue;
+          success = insert_entry (dir_inode, h, new_bucket, e, scratch);
+          if (success) 
+            {
+              e->in_use = false;
+              success = (inode_write_at (dir_inode, e, sizeof *e,
+                                         block_ofs (block) + i * sizeof *e)
+                         == sizeof *e);
+            }
+        }
+    }
+
+  return success && reclaim_overflow (dir_inode, h, old_bucket, &b);
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
+   "." names DIR itself and ".." its parent.
    On success, sets *INODE to an inode for the file, otherwise to
    a null pointer.  The caller must close *INODE. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector;
+  block_sector_t sector;
+  struct dir_header h;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  dir_sector = inode_get_inumber (dir->inode);
+  inode_lock (dir->inode);
+  if (!strcmp (name, "."))
+    sector = dir_sector;
+  else if (!strcmp (name, ".."))
+    sector = read_header (dir->inode, &h) ? h.parent : DCACHE_NEGATIVE;
+  else if (!dcache_lookup (dir_sector, name, &sector)) 
+    {
+      sector = (lookup (dir, name, &e, NULL) ? e.inode_sector
+                : DCACHE_NEGATIVE);
+      dcache_insert (dir_sector, name, sector);
+    }
+  inode_unlock (dir->inode);
 
+  *inode = sector != DCACHE_NEGATIVE ? inode_open (sector) : NULL;
   return *inode != NULL;
 }
 
+/* Returns true if DIR has no entries other than "." and "..",
+   false otherwise. */
+bool
+dir_is_empty (const struct dir *dir) 
+{
+  bool empty;
+
+  inode_lock (dir->inode);
+  empty = is_empty (dir->inode);
+  inode_unlock (dir->inode);
+  return empty;
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
@@ -141,40 +539,49 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_header h;
   struct dir_entry e;
-  off_t ofs;
-  bool success = false;
+  struct dir_bucket b;
+  bool success;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
   /* Check NAME for validity. */
-  if (*name == '\0' || strlen (name) > NAME_MAX)
+  if (*name == '\0' || strlen (name) > NAME_MAX
+      || !strcmp (name, ".") || !strcmp (name, ".."))
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  journal_begin ();
+  inode_lock (dir->inode);
+
+  /* Check that DIR has not been removed and that NAME is not in
+     use. */
+  success = false;
+  if (inode_is_removed (dir->inode) || lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
+  /* Insert the entry, then split a bucket if the table has
+     become too full. */
+  if (!read_header (dir->inode, &h))
+    goto done;
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  success = insert_entry (dir->inode, &h, bucket_of (&h, name), &e, &b);
+  if (success) 
+    {
+      h.entry_cnt++;
+      if (h.entry_cnt > bucket_cnt (&h) * SPLIT_LOAD)
+        split_bucket (dir->inode, &h, &b);
+      success = write_header (dir->inode, &h);
+    }
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
 
  done:
+  inode_unlock (dir->inode);
+  journal_end ();
   return success;
 }
 
@@ -184,14 +591,20 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
+  struct dir_header h;
   struct dir_entry e;
+  struct dir_bucket b;
   struct inode *inode = NULL;
+  bool is_dir = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  journal_begin ();
+  inode_lock (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -201,30 +614,106 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
+  /* Only an empty directory may be removed.  Keep it locked until
+     it is marked removed, so that nothing can be added to it in
+     the meantime. */
+  is_dir = inode_is_dir (inode);
+  if (is_dir) 
+    {
+      inode_lock (inode);
+      if (!is_empty (inode))
+        goto done;
+    }
+
+  /* Erase directory entry and count it gone, putting the entry
+     back if the count cannot be written. */
+  if (!read_header (dir->inode, &h))
+    goto done;
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  h.entry_cnt--;
+  if (!write_header (dir->inode, &h)) 
+    {
+      e.in_use = true;
+      inode_write_at (dir->inode, &e, sizeof e, ofs);
+      goto done;
+    }
+
+  /* Reclaim the overflow buckets this empties.  The entry is gone
+     either way, so a failure here only leaves empty buckets
+     behind. */
+  if (ofs / BLOCK_SECTOR_SIZE >= OVERFLOW_BASE) 
+    {
+      reclaim_overflow (dir->inode, &h, bucket_of (&h, name), &b);
+      write_header (dir->inode, &h);
+    }
+  dcache_insert (inode_get_inumber (dir->inode), name, DCACHE_NEGATIVE);
 
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  if (is_dir)
+    inode_unlock (inode);
+  inode_unlock (dir->inode);
   inode_close (inode);
+  journal_end ();
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.
+
+   DIR's position is a byte offset into its file.  The entries
+   are visited in the primary buckets in order, then in the
+   overflow buckets, skipping the header and the unused blocks
+   between. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
+  bool success;
+
+  inode_lock (dir->inode);
+  success = readdir (dir, name);
+  inode_unlock (dir->inode);
+  return success;
+}
+
+/* Does the work of dir_readdir(), with DIR's inode locked. */
+static bool
+readdir (struct dir *dir, char name[NAME_MAX + 1])
+{
+  struct dir_header h;
   struct dir_entry e;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  if (!read_header (dir->inode, &h))
+    return false;
+
+  for (;;) 
     {
+      uint32_t block = dir->pos / BLOCK_SECTOR_SIZE;
+      size_t slot = dir->pos % BLOCK_SECTOR_SIZE / sizeof e;
+
+      /* Move to the next block that holds entries, if we are not
+         in one already. */
+      if (block == 0 || slot >= BUCKET_ENTRIES) 
+        {
+          dir->pos = block_ofs (block + 1);
+          continue;
+        }
+      if (block > bucket_cnt (&h) && block < OVERFLOW_BASE) 
+        {
+          dir->pos = block_ofs (OVERFLOW_BASE);
+          continue;
+        }
+      if (block >= OVERFLOW_BASE + h.overflow_cnt)
+        return false;
+
+      if (inode_read_at (dir->inode, &e, sizeof e, dir->pos) != sizeof e)
+        memset (&e, 0, sizeof e);
       dir->pos += sizeof e;
       if (e.in_use)
         {
@@ -232,5 +721,4 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
           return true;
         } 
     }
-  return false;
 }
@@ -3,14 +3,27 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Sequential read-ahead window, in sectors.  The window starts
+   at RA_MIN and doubles on each further sequential read, up to
+   RA_MAX. */
+#define RA_MIN 2
+#define RA_MAX 16
+
 /* An open file. */
 struct file 
   {
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    /* Read-ahead state. */
+    off_t ra_next;              /* Offset a sequential read starts at. */
+    off_t ra_end;               /* End of bytes already read ahead. */
+    int ra_window;              /* Window in sectors, 0 if not sequential. */
   };
 
+static void readahead (struct file *, off_t size, off_t file_ofs);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +36,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
@@ -68,7 +84,10 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read;
+
+  readahead (file, size, file->pos);
+  bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,15 +100,15 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
+  readahead (file, size, file_ofs);
   return inode_read_at (file->inode, buffer, size, file_ofs);
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file extends the file.
    Advances FILE's position by the number of bytes read. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
@@ -102,9 +121,8 @@ file_write (struct file *file, const void *buffer, off_t size)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file extends the file.
    The file's current position is unaffected. */
 off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
@@ -166,3 +184,38 @@ file_tell (struct file *file)
   ASSERT (file != NULL);
   return file->pos;
 }
+
+/* Called before reading SIZE bytes from FILE at FILE_OFS.  If
+   the read continues where the previous one left off, grows the
+   read-ahead window and queues the sectors that follow this read
+   within the window, skipping any queued earlier.  Any other
+   read resets the window. */
+static void
+readahead (struct file *file, off_t size, off_t file_ofs) 
+{
+  off_t read_end = file_ofs + size;
+
+  if (file_ofs == file->ra_next) 
+    {
+      off_t start, end;
+
+      if (file->ra_window == 0)
+        file->ra_window = RA_MIN;
+      else if (file->ra_window < RA_MAX)
+        file->ra_window *= 2;
+
+      start = read_end > file->ra_end ? read_end : file->ra_end;
+      end = read_end + file->ra_window * BLOCK_SECTOR_SIZE;
+      if (start < end) 
+        {
+          inode_readahead (file->inode, end - start, start);
+          file->ra_end = end;
+        }
+    }
+  else 
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  file->ra_next = read_end;
+}
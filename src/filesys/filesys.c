@@ -2,14 +2,19 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "filesys/directory.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+static struct dir *resolve (const char *path, char name[NAME_MAX + 1]);
 static void do_format (void);
 
 /* Initializes the file system module.
@@ -21,6 +26,9 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  journal_init (format);
+  cache_init ();
+  dcache_init ();
   inode_init ();
   free_map_init ();
 
@@ -35,6 +43,9 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  do
+    journal_commit ();
+  while (free_map_pending ());
   free_map_close ();
 }
 
@@ -45,15 +56,48 @@ filesys_done (void)
 bool
 filesys_create (const char *name, off_t initial_size) 
 {
+  char last[NAME_MAX + 1];
   block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = resolve (name, last);
+  success = (dir != NULL
+             && free_map_allocate (1, &inode_sector)
+             && inode_create (inode_sector, initial_size, false)
+             && dir_add (dir, last, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
+
+  return success;
+}
+
+/* Creates a directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists,
+   or if internal memory allocation fails. */
+bool
+filesys_mkdir (const char *name) 
+{
+  char last[NAME_MAX + 1];
+  block_sector_t inode_sector = 0;
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = resolve (name, last);
+  success = (dir != NULL
+             && free_map_allocate (1, &inode_sector)
+             && dir_create (inode_sector,
+                            inode_get_inumber (dir_get_inode (dir)), 16)
+             && dir_add (dir, last, inode_sector));
+  if (!success && inode_sector != 0) 
+    free_map_release (inode_sector, 1);
+  dir_close (dir);
+  journal_end ();
 
   return success;
 }
@@ -66,11 +110,12 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
+  char last[NAME_MAX + 1];
+  struct dir *dir = resolve (name, last);
   struct inode *inode = NULL;
 
   if (dir != NULL)
-    dir_lookup (dir, name, &inode);
+    dir_lookup (dir, last, &inode);
   dir_close (dir);
 
   return file_open (inode);
@@ -83,21 +128,98 @@ filesys_open (const char *name)
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char last[NAME_MAX + 1];
+  struct dir *dir = resolve (name, last);
+  bool success = dir != NULL && dir_remove (dir, last);
   dir_close (dir); 
 
   return success;
 }
-
+
+/* Makes the directory named NAME the running thread's current
+   directory, against which relative names are resolved.
+   Returns true if successful, false on failure. */
+bool
+filesys_chdir (const char *name) 
+{
+  char last[NAME_MAX + 1];
+  struct thread *t = thread_current ();
+  struct dir *dir = resolve (name, last);
+  struct inode *inode = NULL;
+  struct dir *cwd;
+
+  if (dir != NULL)
+    dir_lookup (dir, last, &inode);
+  dir_close (dir);
+
+  cwd = dir_open (inode);
+  if (cwd == NULL)
+    return false;
+  dir_close (t->cwd);
+  t->cwd = cwd;
+  return true;
+}
+
+/* Resolves all but the last component of PATH, which may be
+   absolute or relative to the running thread's current
+   directory.  Returns the directory so found, which the caller
+   must close, and copies the last component into NAME.  A PATH
+   with no last component, such as "/", yields the directory it
+   names and "." in NAME.
+   Returns a null pointer if PATH is empty, has a component
+   longer than NAME_MAX, or passes through something that is not
+   an existing directory.
+
+   Each step looks up one name in one directory, which is
+   usually answered by the directory entry cache, so resolving a
+   path that was resolved recently reads no directory blocks. */
+static struct dir *
+resolve (const char *path, char name[NAME_MAX + 1])
+{
+  struct dir *cwd = thread_current ()->cwd;
+  struct dir *dir;
+
+  if (*path == '\0')
+    return NULL;
+  dir = *path == '/' || cwd == NULL ? dir_open_root () : dir_reopen (cwd);
+  strlcpy (name, ".", NAME_MAX + 1);
+
+  for (;;) 
+    {
+      struct inode *inode;
+      size_t len;
+
+      while (*path == '/')
+        path++;
+      if (*path == '\0' || dir == NULL)
+        return dir;
+      len = strcspn (path, "/");
+      if (len > NAME_MAX) 
+        {
+          dir_close (dir);
+          return NULL;
+        }
+
+      /* Descend into the previous component, and make this one
+         the last component so far. */
+      dir_lookup (dir, name, &inode);
+      dir_close (dir);
+      dir = dir_open (inode);
+      memcpy (name, path, len);
+      name[len] = '\0';
+      path += len;
+    }
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_commit ();
   free_map_close ();
   printf ("done.\n");
 }
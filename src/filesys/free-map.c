@@ -1,12 +1,82 @@
 #include "filesys/free-map.h"
+#include <avl.h>
 #include <bitmap.h>
 #include <debug.h>
+#include <list.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects all free map state. */
+
+/* Allocating or releasing sectors only changes the in-memory
+   bitmap and marks the sector-sized chunks of the free map file
+   that it touched in dirty_chunks.  free_map_sync() writes just
+   those chunks to the file, so the cost of keeping the file up
+   to date depends on how many sectors changed, not on the size
+   of the disk.  Each chunk written is a sector in the journal's
+   transaction, so an allocation that dirties a chunk reserves a
+   journal slot for it with journal_reserve_map(). */
+#define CHUNK_BITS (BLOCK_SECTOR_SIZE * 8)   /* Free map bits per chunk. */
+static struct bitmap *dirty_chunks;  /* One bit per free map file chunk. */
+
+/* Released sectors are not allocated again until the release has
+   been committed by the journal.  Otherwise, a crash could leave
+   a file that was deleted but not yet committed pointing to
+   sectors that had been allocated and overwritten since.  So
+   free_map_release() only records the sectors as runs in
+   `released'.  free_map_sync(), which journal_commit() calls,
+   frees them in the bitmap, so that the commit includes them,
+   and returns them to the free extents.  It frees only as many
+   as the chunks that the transaction has room for allow; the
+   rest wait for a later commit.  Until they are freed, released
+   sectors count as in use, so a crash in the meantime only leaks
+   them. */
+struct released_run 
+  {
+    struct list_elem elem;              /* Element in `released'. */
+    block_sector_t start;               /* First sector. */
+    size_t size;                        /* Number of sectors. */
+  };
+
+static struct list released;         /* Runs released since last sync. */
+
+/* The free map bitmap is the on-disk record of which sectors are
+   in use.  In memory, the same information is also kept as a set
+   of maximal runs of free sectors, or "extents", indexed two ways
+   so that allocation never has to scan the bitmap:
+
+      - by_start orders extents by first sector, to find the
+        extent that contains or follows a goal sector and to
+        find the neighbors to merge with on release.
+
+      - by_size orders extents by length, then first sector, to
+        find the smallest extent large enough for a request. */
+struct extent 
+  {
+    struct avl_elem start_elem;         /* Element in by_start. */
+    struct avl_elem size_elem;          /* Element in by_size. */
+    block_sector_t start;               /* First free sector. */
+    size_t size;                        /* Number of free sectors. */
+  };
+
+static struct avl by_start;          /* Free extents by start. */
+static struct avl by_size;           /* Free extents by size. */
+
+static bool allocate_extent (block_sector_t goal, size_t cnt,
+                             block_sector_t *sectorp);
+static void release_extent (block_sector_t, size_t cnt);
+static void defer_release (block_sector_t, size_t cnt);
+static void build_extents (void);
+static size_t mark_dirty (block_sector_t, size_t cnt);
+static size_t chunks_to_dirty (block_sector_t, size_t cnt);
+static void free_released (size_t room);
 
 /* Initializes the free map. */
 void
@@ -17,36 +87,104 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  dirty_chunks = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                              CHUNK_BITS));
+  if (dirty_chunks == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
+  list_init (&released);
+  build_extents ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.  The change reaches the free map file
+   at the next free_map_sync(). */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Like free_map_allocate(), but prefers to allocate the CNT
+   sectors starting at GOAL, or failing that, the first free run
+   after GOAL that is large enough.  A GOAL of 0 means no
+   preference, because sector 0 is never free. */
+bool
+free_map_allocate_near (block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  block_sector_t sector;
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate_extent (goal, cnt, &sector);
+  if (success) 
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      ASSERT (bitmap_none (free_map, sector, cnt));
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      journal_reserve_map (mark_dirty (sector, cnt));
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  lock_release (&free_map_lock);
+  return success;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use, once
+   the release is committed. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  defer_release (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Frees the sectors released since the last call, as far as ROOM
+   more dirty chunks allow, then writes the chunks of the free map
+   changed since the last call to the free map file.  Called by
+   journal_commit(), with ROOM the number of journal slots it has
+   left for chunks beyond those already reserved, so that the
+   chunks are committed along with the changes that caused
+   them. */
+void
+free_map_sync (size_t room) 
+{
+  size_t chunk;
+
+  if (free_map_file == NULL)
+    return;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  free_released (room);
+  for (chunk = bitmap_scan (dirty_chunks, 0, 1, true);
+       chunk != BITMAP_ERROR;
+       chunk = bitmap_scan (dirty_chunks, chunk, 1, true)) 
+    {
+      bitmap_reset (dirty_chunks, chunk);
+      if (!bitmap_write_part (free_map, free_map_file,
+                              chunk * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+        PANIC ("can't write free map");
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
+}
+
+/* Returns true if some released sectors have not been freed yet
+   because earlier commits had no room for them. */
+bool
+free_map_pending (void) 
+{
+  bool pending;
+
+  lock_acquire (&free_map_lock);
+  pending = !list_empty (&released);
+  lock_release (&free_map_lock);
+  return pending;
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +196,19 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  lock_acquire (&free_map_lock);
+  bitmap_set_all (dirty_chunks, false);
+  build_extents ();
+  lock_release (&free_map_lock);
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Closes the free map file.  Its changes must already have been
+   committed with journal_commit(). */
 void
 free_map_close (void) 
 {
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -73,13 +217,321 @@ void
 free_map_create (void) 
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
+  /* Write bitmap to file.  Writing it allocates the file's
+     sectors, which changes the bitmap in chunks that may have
+     been written already, so those chunks stay marked dirty for
+     the next free_map_sync(). */
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  bitmap_set_all (dirty_chunks, false);
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
 }
+
+/* Marks the free map file chunks holding the bits for the CNT
+   sectors starting at SECTOR as needing to be written.  Returns
+   the number of chunks that were not already marked. */
+static size_t
+mark_dirty (block_sector_t sector, size_t cnt) 
+{
+  size_t first = sector / CHUNK_BITS;
+  size_t last = (sector + cnt - 1) / CHUNK_BITS;
+  size_t new_cnt = chunks_to_dirty (sector, cnt);
+
+  bitmap_set_multiple (dirty_chunks, first, last - first + 1, true);
+  return new_cnt;
+}
+
+/* Returns the number of free map file chunks holding bits for
+   the CNT sectors starting at SECTOR that are not yet marked
+   dirty. */
+static size_t
+chunks_to_dirty (block_sector_t sector, size_t cnt) 
+{
+  size_t first = sector / CHUNK_BITS;
+  size_t last = (sector + cnt - 1) / CHUNK_BITS;
+
+  return (last - first + 1
+          - bitmap_count (dirty_chunks, first, last - first + 1, true));
+}
+
+/* Frees released sectors in the bitmap and returns them to the
+   free extents, oldest first, stopping before the number of
+   newly dirtied chunks would exceed ROOM.  A run is freed a chunk
+   at a time, so that a run longer than ROOM chunks still makes
+   progress.  free_map_lock must be held. */
+static void
+free_released (size_t room) 
+{
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+
+  while (!list_empty (&released)) 
+    {
+      struct released_run *r = list_entry (list_front (&released),
+                                           struct released_run, elem);
+      block_sector_t chunk_end = (r->start / CHUNK_BITS + 1) * CHUNK_BITS;
+      size_t cnt = r->size;
+      size_t need;
+
+      if (cnt > chunk_end - r->start)
+        cnt = chunk_end - r->start;
+      need = chunks_to_dirty (r->start, cnt);
+      if (need > room)
+        break;
+      room -= need;
+
+      bitmap_set_multiple (free_map, r->start, cnt, false);
+      mark_dirty (r->start, cnt);
+      release_extent (r->start, cnt);
+      r->start += cnt;
+      r->size -= cnt;
+      if (r->size == 0) 
+        {
+          list_remove (&r->elem);
+          free (r);
+        }
+    }
+}
+
+/* Orders extents A and B by start sector. */
+static bool
+start_less (const struct avl_elem *a_, const struct avl_elem *b_,
+            void *aux UNUSED) 
+{
+  const struct extent *a = avl_entry (a_, struct extent, start_elem);
+  const struct extent *b = avl_entry (b_, struct extent, start_elem);
+  return a->start < b->start;
+}
+
+/* Orders extents A and B by size, then by start sector. */
+static bool
+size_less (const struct avl_elem *a_, const struct avl_elem *b_,
+           void *aux UNUSED) 
+{
+  const struct extent *a = avl_entry (a_, struct extent, size_elem);
+  const struct extent *b = avl_entry (b_, struct extent, size_elem);
+  if (a->size != b->size)
+    return a->size < b->size;
+  return a->start < b->start;
+}
+
+/* Returns the extent whose start is the greatest at or before
+   SECTOR, or a null pointer if there is none. */
+static struct extent *
+extent_at_or_before (block_sector_t sector) 
+{
+  struct extent key;
+  struct avl_elem *e;
+
+  key.start = sector;
+  e = avl_floor (&by_start, &key.start_elem);
+  return e != NULL ? avl_entry (e, struct extent, start_elem) : NULL;
+}
+
+/* Returns the extent whose start is the least at or after
+   SECTOR, or a null pointer if there is none. */
+static struct extent *
+extent_at_or_after (block_sector_t sector) 
+{
+  struct extent key;
+  struct avl_elem *e;
+
+  key.start = sector;
+  e = avl_ceiling (&by_start, &key.start_elem);
+  return e != NULL ? avl_entry (e, struct extent, start_elem) : NULL;
+}
+
+/* Returns the smallest extent of at least CNT sectors, or a null
+   pointer if there is none. */
+static struct extent *
+smallest_fit (size_t cnt) 
+{
+  struct extent key;
+  struct avl_elem *e;
+
+  key.size = cnt;
+  key.start = 0;
+  e = avl_ceiling (&by_size, &key.size_elem);
+  return e != NULL ? avl_entry (e, struct extent, size_elem) : NULL;
+}
+
+/* Adds a new extent of SIZE sectors starting at START, which
+   must not touch any existing extent.  Returns false if memory
+   is exhausted. */
+static bool
+insert_extent (block_sector_t start, size_t size) 
+{
+  struct extent *e = malloc (sizeof *e);
+  if (e == NULL)
+    return false;
+  e->start = start;
+  e->size = size;
+  avl_insert (&by_start, &e->start_elem);
+  avl_insert (&by_size, &e->size_elem);
+  return true;
+}
+
+/* Removes extent E from both indexes and frees it. */
+static void
+delete_extent (struct extent *e) 
+{
+  avl_delete (&by_start, &e->start_elem);
+  avl_delete (&by_size, &e->size_elem);
+  free (e);
+}
+
+/* Changes extent E to cover SIZE sectors starting at START.  The
+   new range must not overlap or touch any other extent, so that
+   E keeps its place in by_start. */
+static void
+resize_extent (struct extent *e, block_sector_t start, size_t size) 
+{
+  avl_delete (&by_size, &e->size_elem);
+  e->start = start;
+  e->size = size;
+  avl_insert (&by_size, &e->size_elem);
+}
+
+/* Chooses CNT consecutive free sectors and removes them from the
+   free extents, storing the first into *SECTORP.  The sectors
+   start at GOAL if they are free; otherwise they come from the
+   first extent after GOAL large enough to hold them; otherwise
+   from the smallest extent large enough.  Returns false if no
+   extent is large enough. */
+static bool
+allocate_extent (block_sector_t goal, size_t cnt, block_sector_t *sectorp)
+{
+  struct extent *e;
+  block_sector_t sector;
+  size_t head, tail;
+
+  /* Find an extent and the sector within it to start at. */
+  e = extent_at_or_before (goal);
+  if (e != NULL && goal - e->start < e->size
+      && e->start + e->size - goal >= cnt)
+    sector = goal;
+  else 
+    {
+      /* Skipping small extents one by one in search of a larger
+         one would be a linear scan, so if the very next extent
+         is too small, give up on locality. */
+      e = extent_at_or_after (goal);
+      if (e == NULL || e->size < cnt)
+        e = smallest_fit (cnt);
+      if (e == NULL)
+        return false;
+      sector = e->start;
+    }
+
+  /* Carve the allocation out of the extent, leaving HEAD sectors
+     before it and TAIL sectors after it free. */
+  head = sector - e->start;
+  tail = e->size - head - cnt;
+  if (head > 0 && tail > 0 && !insert_extent (sector + cnt, tail)) 
+    {
+      /* No memory to split the extent: take its start instead. */
+      sector = e->start;
+      head = 0;
+      tail = e->size - cnt;
+    }
+  if (head > 0)
+    resize_extent (e, e->start, head);
+  else if (tail > 0)
+    resize_extent (e, sector + cnt, tail);
+  else
+    delete_extent (e);
+
+  *sectorp = sector;
+  return true;
+}
+
+/* Returns the CNT sectors starting at SECTOR to the free extents,
+   merging them with the extents on either side if they touch. */
+static void
+release_extent (block_sector_t sector, size_t cnt) 
+{
+  struct extent *prev = extent_at_or_before (sector);
+  struct extent *next = extent_at_or_after (sector);
+  bool join_prev = prev != NULL && prev->start + prev->size == sector;
+  bool join_next = next != NULL && sector + cnt == next->start;
+
+  if (join_prev && join_next) 
+    {
+      size_t size = prev->size + cnt + next->size;
+      delete_extent (next);
+      resize_extent (prev, prev->start, size);
+    }
+  else if (join_prev)
+    resize_extent (prev, prev->start, prev->size + cnt);
+  else if (join_next)
+    resize_extent (next, sector, cnt + next->size);
+  else 
+    {
+      /* If memory is exhausted, the sectors stay free in the
+         bitmap but cannot be allocated until the extents are
+         rebuilt from it at the next boot. */
+      insert_extent (sector, cnt);
+    }
+}
+
+/* Records that the CNT sectors starting at SECTOR have been
+   released, to free them at a later free_map_sync().  Extends
+   the most recently released run if the sectors follow it, as
+   they do when a file laid out contiguously is deleted. */
+static void
+defer_release (block_sector_t sector, size_t cnt) 
+{
+  struct released_run *r;
+
+  if (!list_empty (&released)) 
+    {
+      r = list_entry (list_back (&released), struct released_run, elem);
+      if (r->start + r->size == sector) 
+        {
+          r->size += cnt;
+          return;
+        }
+    }
+
+  /* If memory is exhausted, the sectors stay in use, as they
+     would if the system stopped before the release was
+     committed. */
+  r = malloc (sizeof *r);
+  if (r == NULL)
+    return;
+  r->start = sector;
+  r->size = cnt;
+  list_push_back (&released, &r->elem);
+}
+
+/* Discards any existing free extents and rebuilds them from the
+   free map bitmap. */
+static void
+build_extents (void) 
+{
+  size_t sector_cnt = bitmap_size (free_map);
+  size_t start, end;
+
+  if (by_start.less != NULL)
+    while (!avl_empty (&by_start))
+      delete_extent (avl_entry (avl_min (&by_start),
+                                struct extent, start_elem));
+  avl_init (&by_start, start_less, NULL);
+  avl_init (&by_size, size_less, NULL);
+
+  for (start = bitmap_scan (free_map, 0, 1, false);
+       start != BITMAP_ERROR;
+       start = end < sector_cnt ? bitmap_scan (free_map, end, 1, false)
+                                : BITMAP_ERROR) 
+    {
+      end = bitmap_scan (free_map, start, 1, true);
+      if (end == BITMAP_ERROR)
+        end = sector_cnt;
+      if (!insert_extent (start, end - start))
+        PANIC ("not enough memory for free map extents");
+    }
+}
@@ -0,0 +1,239 @@
+#include "filesys/fsbench.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/directory.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/io.h"
+#include "threads/malloc.h"
+
+/* File system benchmarks, run from the kernel command line with
+   the `bench' action.  Each prints how long its operations took
+   in timer ticks and in CPU cycles per operation. */
+
+typedef void bench_func (void);
+
+static bench_func bench_dir_10k;
+static bench_func bench_open_1k;
+static bench_func bench_block_io;
+
+/* A benchmark. */
+struct benchmark 
+  {
+    const char *name;           /* Name given to `bench'. */
+    bench_func *function;       /* Function that runs it. */
+  };
+
+static const struct benchmark benchmarks[] = 
+  {
+    {"dir-10k", bench_dir_10k},
+    {"open-1k", bench_open_1k},
+    {"block-io", bench_block_io},
+  };
+
+/* Runs the benchmark named ARGV[1]. */
+void
+fsbench_run (char **argv) 
+{
+  const char *name = argv[1];
+  size_t i;
+
+  for (i = 0; i < sizeof benchmarks / sizeof *benchmarks; i++)
+    if (!strcmp (name, benchmarks[i].name)) 
+      {
+        printf ("Benchmark '%s':\n", name);
+        benchmarks[i].function ();
+        printf ("Benchmark '%s' complete.\n", name);
+        return;
+      }
+  PANIC ("no benchmark named \"%s\"", name);
+}
+
+/* Reports that OP_CNT operations described by WHAT took from
+   START_TICKS and START_TSC until now. */
+static void
+report (const char *what, int op_cnt, int64_t start_ticks,
+        uint64_t start_tsc) 
+{
+  uint64_t cycles = rdtsc () - start_tsc;
+
+  printf ("%s: %d in %lld ticks, %llu cycles each\n",
+          what, op_cnt, timer_elapsed (start_ticks), cycles / op_cnt);
+}
+
+/* Adds 10,000 names to a new directory, looks each one up,
+   removes each one, and then deletes the directory.  Every entry
+   points to the same empty file, which stays open until the end
+   so that removing one name does not free it for the others, and
+   so only the directory takes space. */
+#define DIR_NAME_CNT 10000
+
+static void
+bench_dir_10k (void) 
+{
+  block_sector_t sector, file_sector;
+  struct inode *file;
+  struct dir *dir;
+  char name[NAME_MAX + 1];
+  int64_t start_ticks;
+  uint64_t start_tsc;
+  int i;
+
+  if (!free_map_allocate (1, &sector)
+      || !dir_create (sector, ROOT_DIR_SECTOR, 0))
+    PANIC ("can't create benchmark directory");
+  dir = dir_open (inode_open (sector));
+  if (dir == NULL)
+    PANIC ("can't open benchmark directory");
+  if (!free_map_allocate (1, &file_sector)
+      || !inode_create (file_sector, 0, false))
+    PANIC ("can't create benchmark file");
+  file = inode_open (file_sector);
+  if (file == NULL)
+    PANIC ("can't open benchmark file");
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  for (i = 0; i < DIR_NAME_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "file%d", i);
+      if (!dir_add (dir, name, file_sector))
+        PANIC ("dir_add of %s failed", name);
+    }
+  report ("dir_add", DIR_NAME_CNT, start_ticks, start_tsc);
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  for (i = 0; i < DIR_NAME_CNT; i++) 
+    {
+      struct inode *inode;
+
+      snprintf (name, sizeof name, "file%d", i);
+      if (!dir_lookup (dir, name, &inode))
+        PANIC ("dir_lookup of %s failed", name);
+      inode_close (inode);
+    }
+  report ("dir_lookup", DIR_NAME_CNT, start_ticks, start_tsc);
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  for (i = 0; i < DIR_NAME_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "file%d", i);
+      if (!dir_remove (dir, name))
+        PANIC ("dir_remove of %s failed", name);
+    }
+  report ("dir_remove", DIR_NAME_CNT, start_ticks, start_tsc);
+
+  inode_close (file);
+  inode_remove (dir_get_inode (dir));
+  dir_close (dir);
+}
+
+/* Creates 1,000 files and keeps them all open, then opens and
+   closes each file's inode again OPEN_ROUNDS times, so that
+   every inode_open() has to find its inode among 1,000 open
+   ones.  Finally deletes the files. */
+#define OPEN_FILE_CNT 1000
+#define OPEN_ROUNDS 10
+
+static void
+bench_open_1k (void) 
+{
+  struct file **files;
+  char name[NAME_MAX + 1];
+  int64_t start_ticks;
+  uint64_t start_tsc;
+  int i, round;
+
+  files = malloc (OPEN_FILE_CNT * sizeof *files);
+  if (files == NULL)
+    PANIC ("out of memory");
+
+  for (i = 0; i < OPEN_FILE_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "bench%d", i);
+      if (!filesys_create (name, 0))
+        PANIC ("can't create %s", name);
+      files[i] = filesys_open (name);
+      if (files[i] == NULL)
+        PANIC ("can't open %s", name);
+    }
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  for (round = 0; round < OPEN_ROUNDS; round++)
+    for (i = 0; i < OPEN_FILE_CNT; i++) 
+      {
+        block_sector_t sector = inode_get_inumber (file_get_inode (files[i]));
+        inode_close (inode_open (sector));
+      }
+  report ("inode_open", OPEN_FILE_CNT * OPEN_ROUNDS, start_ticks, start_tsc);
+
+  for (i = 0; i < OPEN_FILE_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "bench%d", i);
+      file_close (files[i]);
+      filesys_remove (name);
+    }
+  free (files);
+}
+
+/* Reads the first BLOCK_SECTOR_CNT sectors of the file system
+   device, one sector at a time and bypassing the buffer cache,
+   then writes the same data back, and then does the same again
+   with one multi-sector request each way.  Compare runs with and
+   without the -pio option to see what DMA saves per sector; the
+   idle ticks in the statistics printed at shutdown show how much
+   of the time the CPU was free. */
+#define BLOCK_SECTOR_CNT 256
+
+static void
+bench_block_io (void) 
+{
+  block_sector_t sector_cnt = block_size (fs_device);
+  uint8_t *buffer;
+  int64_t start_ticks;
+  uint64_t start_tsc;
+  block_sector_t i;
+
+  if (sector_cnt > BLOCK_SECTOR_CNT)
+    sector_cnt = BLOCK_SECTOR_CNT;
+  buffer = malloc (sector_cnt * BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
+    PANIC ("out of memory");
+
+  /* Bring the disk up to date first, so that the data written
+     back is current. */
+  journal_commit ();
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  for (i = 0; i < sector_cnt; i++)
+    block_read (fs_device, i, buffer + i * BLOCK_SECTOR_SIZE);
+  report ("block_read", sector_cnt, start_ticks, start_tsc);
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  for (i = 0; i < sector_cnt; i++)
+    block_write (fs_device, i, buffer + i * BLOCK_SECTOR_SIZE);
+  report ("block_write", sector_cnt, start_ticks, start_tsc);
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  block_read_multiple (fs_device, 0, buffer, sector_cnt);
+  report ("block_read_multiple", sector_cnt, start_ticks, start_tsc);
+
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+  block_write_multiple (fs_device, 0, buffer, sector_cnt);
+  report ("block_write_multiple", sector_cnt, start_ticks, start_tsc);
+
+  free (buffer);
+}
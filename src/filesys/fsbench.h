@@ -0,0 +1,6 @@
+#ifndef FILESYS_FSBENCH_H
+#define FILESYS_FSBENCH_H
+
+void fsbench_run (char **argv);
+
+#endif /* filesys/fsbench.h */
@@ -1,23 +1,54 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Block map geometry.  An inode points to its first DIRECT_CNT
+   data sectors directly, to the next PTRS_PER_SECTOR through an
+   indirect block, and to the rest through a doubly indirect
+   block.  A null pointer marks a hole, which reads as zeros;
+   sector 0 holds the free map inode, so it is never a data or
+   pointer block. */
+#define DIRECT_CNT 123
+#define PTRS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+#define MAX_SECTORS (DIRECT_CNT + PTRS_PER_SECTOR \
+                     + PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+
+/* A file no longer than INLINE_MAX bytes may keep its data in
+   the inode itself, in place of the block map, so that it needs
+   no data sectors at all.  It moves to data sectors when it
+   grows past INLINE_MAX bytes. */
+#define INLINE_MAX ((off_t) ((DIRECT_CNT + 2) * sizeof (block_sector_t)))
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint16_t is_dir;                    /* 1 for a directory, 0 for a file. */
+    uint16_t is_inline;                 /* 1 if data is in inline_data. */
+    union 
+      {
+        struct 
+          {
+            block_sector_t direct[DIRECT_CNT]; /* Direct data sectors. */
+            block_sector_t indirect;    /* Indirect block. */
+            block_sector_t dbl_indirect; /* Doubly indirect block. */
+          };
+        uint8_t inline_data[INLINE_MAX]; /* Data of an inline file. */
+      };
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,49 +59,91 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   `rw' makes reads and writes of the inode's data atomic with
+   respect to each other, except that inode_write_at() makes a
+   long write as a series of writes of up to WRITE_PIECE sectors,
+   each atomic on its own.  Reads hold it for reading, so any
+   number of them proceed at once; writes, which may allocate
+   sectors and extend the file, hold it for writing.  It also
+   protects `deny_write_cnt' and `removed'.  `lock' is separate
+   and is only held by callers of inode_lock(), to make a
+   sequence of reads and writes atomic, and by inode_open() while
+   it reads the inode from disk.  `open_cnt' and `loading' are
+   protected by open_inodes_lock. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* Being read by inode_open()? */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    struct rwlock rw;                   /* Guards data and deny_write_cnt. */
+    struct lock lock;                   /* See inode_lock(). */
     struct inode_disk data;             /* Inode content. */
   };
 
+static block_sector_t index_to_sector (struct inode_disk *, size_t idx,
+                                       bool *allocated);
+static bool promote (struct inode_disk *, bool metadata);
+static off_t fill (struct inode *, off_t size, off_t offset);
+static off_t write_piece (struct inode *, const uint8_t *, off_t size,
+                          off_t offset);
+static void deallocate (struct inode_disk *);
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, either because POS is past end of file, because it lies
+   in a hole, or because INODE's data is inline. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
-    return -1;
+  if (pos < inode->data.length && !inode->data.is_inline) 
+    {
+      block_sector_t sector = index_to_sector (&inode->data,
+                                               pos / BLOCK_SECTOR_SIZE,
+                                               NULL);
+      if (sector != 0)
+        return sector;
+    }
+  return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  open_inodes_lock
+   protects the table and every inode's `open_cnt'. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't create open inode table");
+  lock_init (&open_inodes_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The inode is for a directory if IS_DIR is true, for
+   an ordinary file otherwise.
+   The data starts out as zeros.  If LENGTH is at most INLINE_MAX,
+   it is kept inline in the inode; otherwise, it is one big hole,
+   so no data sectors are allocated or written until they are
+   first written, however large LENGTH is.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails or LENGTH is larger
+   than the largest possible file. */
 bool
-inode_create (block_sector_t sector, off_t length)
+inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -84,22 +157,18 @@ inode_create (block_sector_t sector, off_t length)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
+      disk_inode->is_dir = is_dir;
+      disk_inode->is_inline = length <= INLINE_MAX;
+      success = bytes_to_sectors (length) <= MAX_SECTORS;
+      if (success) 
         {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
+          journal_begin ();
+          journal_log (sector);
+          cache_write (sector, disk_inode);
+          journal_end ();
+        }
       free (disk_inode);
     }
   return success;
@@ -111,33 +180,62 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
+  lock_acquire (&open_inodes_lock);
+
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL) 
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      bool loading;
+
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      loading = inode->loading;
+      lock_release (&open_inodes_lock);
+
+      /* Wait for the opener that is reading it to finish. */
+      if (loading) 
         {
-          inode_reopen (inode);
-          return inode; 
+          lock_acquire (&inode->lock);
+          lock_release (&inode->lock);
         }
+      return inode; 
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
-  if (inode == NULL)
-    return NULL;
+  if (inode == NULL) 
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize, and insert the inode marked as loading, so that
+     other openers of SECTOR find it.  Read it from disk holding
+     only its own lock, which they wait on, so that opening other
+     inodes does not wait for the read. */
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  rwlock_init (&inode->rw);
+  lock_init (&inode->lock);
+  lock_acquire (&inode->lock);
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  cache_read (inode->sector, &inode->data);
+
+  lock_acquire (&open_inodes_lock);
+  inode->loading = false;
+  lock_release (&open_inodes_lock);
+  lock_release (&inode->lock);
   return inode;
 }
 
@@ -145,8 +243,12 @@ inode_open (block_sector_t sector)
 struct inode *
 inode_reopen (struct inode *inode)
 {
-  if (inode != NULL)
-    inode->open_cnt++;
+  if (inode != NULL) 
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -163,22 +265,29 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
+  /* Remove from open inode table if this was the last opener. */
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
+          if (inode->data.is_dir)
+            dcache_purge (inode->sector);
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          deallocate (&inode->data);
         }
 
       free (inode); 
@@ -191,7 +300,38 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  rwlock_acquire_write (&inode->rw);
   inode->removed = true;
+  rwlock_release_write (&inode->rw);
+}
+
+/* Returns true if INODE has been marked for deletion by
+   inode_remove(), false otherwise. */
+bool
+inode_is_removed (struct inode *inode) 
+{
+  bool removed;
+
+  rwlock_acquire_read (&inode->rw);
+  removed = inode->removed;
+  rwlock_release_read (&inode->rw);
+  return removed;
+}
+
+/* Acquires INODE's lock, which excludes other callers of this
+   function but not readers or writers.  Directories use it to
+   make a lookup and the update that depends on it atomic. */
+void
+inode_lock (struct inode *inode) 
+{
+  lock_acquire (&inode->lock);
+}
+
+/* Releases INODE's lock, acquired with inode_lock(). */
+void
+inode_unlock (struct inode *inode) 
+{
+  lock_release (&inode->lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -202,7 +342,23 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  off_t fill_end = 0;
+
+  rwlock_acquire_read (&inode->rw);
+  if (inode->data.is_inline) 
+    {
+      /* The data is in the inode, which is already in memory. */
+      off_t inode_left = inode_length (inode) - offset;
+      if (size > inode_left)
+        size = inode_left;
+      if (size > 0) 
+        {
+          memcpy (buffer, inode->data.inline_data + offset, size);
+          bytes_read = size;
+        }
+      rwlock_release_read (&inode->rw);
+      return bytes_read;
+    }
 
   while (size > 0) 
     {
@@ -220,99 +376,202 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      /* Bring the sectors that the rest of the read covers into
+         the cache together, if they are next to each other on
+         disk. */
+      if (offset >= fill_end && size > sector_left)
+        fill_end = fill (inode, size, offset);
+
+      /* Copy the chunk out of the buffer cache, or zeros out of
+         a hole. */
+      if (sector_idx != (block_sector_t) -1)
+        cache_read_at (sector_idx, buffer + bytes_read, sector_ofs,
+                       chunk_size);
+      else
+        memset (buffer + bytes_read, 0, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+
+  rwlock_release_read (&inode->rw);
 
   return bytes_read;
 }
 
+/* Reads the sectors of INODE that hold the SIZE bytes starting
+   at OFFSET into the buffer cache, as far as they are
+   consecutive on disk and at most CACHE_FILL_MAX of them, with a
+   single disk request.  Returns the offset just past the
+   sectors considered.  INODE's `rw' must be held. */
+static off_t
+fill (struct inode *inode, off_t size, off_t offset) 
+{
+  off_t pos = offset - offset % BLOCK_SECTOR_SIZE;
+  block_sector_t first = byte_to_sector (inode, pos);
+  size_t cnt = 1;
+
+  if (first == (block_sector_t) -1)
+    return pos + BLOCK_SECTOR_SIZE;
+  while (cnt < CACHE_FILL_MAX
+         && pos + (off_t) cnt * BLOCK_SECTOR_SIZE < offset + size
+         && byte_to_sector (inode, pos + cnt * BLOCK_SECTOR_SIZE)
+            == first + cnt)
+    cnt++;
+  if (cnt > 1)
+    cache_fill (first, cnt);
+  return pos + cnt * BLOCK_SECTOR_SIZE;
+}
+
+/* Asks the buffer cache to read the sectors holding the SIZE
+   bytes of INODE starting at OFFSET in the background, as far as
+   end of file. */
+void
+inode_readahead (struct inode *inode, off_t size, off_t offset) 
+{
+  off_t end = offset + size;
+  off_t pos;
+
+  rwlock_acquire_read (&inode->rw);
+  if (end > inode_length (inode))
+    end = inode_length (inode);
+  for (pos = offset - offset % BLOCK_SECTOR_SIZE; pos < end;
+       pos += BLOCK_SECTOR_SIZE) 
+    {
+      block_sector_t sector = byte_to_sector (inode, pos);
+      if (sector != (block_sector_t) -1)
+        cache_readahead (sector);
+    }
+  rwlock_release_read (&inode->rw);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up, the file reaches its
+   maximum size, or an error occurs.  Writing past end of file
+   extends the inode; any gap between the old end of file and
+   OFFSET is left as a hole.
+   Changes to the inode and its pointer blocks are journaled, as
+   are the data of directories and of the free map.  Each piece
+   of up to WRITE_PIECE sectors, or METADATA_PIECE for a file
+   whose data is journaled, is a separate journal operation, so
+   that no operation logs more sectors than the journal allows:
+   an aligned piece needs at most one block of each level of the
+   block map. */
+#define WRITE_PIECE 64
+#define METADATA_PIECE 4
+
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
+  bool metadata = inode_is_dir (inode) || inode->sector == FREE_MAP_SECTOR;
+  off_t piece_size = ((metadata ? METADATA_PIECE : WRITE_PIECE)
+                      * BLOCK_SECTOR_SIZE);
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
 
-  if (inode->deny_write_cnt)
-    return 0;
+  do 
+    {
+      off_t chunk_size = piece_size - offset % piece_size;
+      off_t written;
+
+      if (chunk_size > size)
+        chunk_size = size;
+      written = write_piece (inode, buffer + bytes_written, chunk_size,
+                             offset);
+      bytes_written += written;
+      offset += written;
+      size -= written;
+      if (written < chunk_size)
+        break;
+    }
+  while (size > 0);
+  return bytes_written;
+}
+
+/* Does the work of inode_write_at() for SIZE bytes from BUFFER
+   at OFFSET, as one journal operation. */
+static off_t
+write_piece (struct inode *inode, const uint8_t *buffer, off_t size,
+             off_t offset) 
+{
+  off_t bytes_written = 0;
+  bool allocated = false;
+  bool metadata = inode_is_dir (inode) || inode->sector == FREE_MAP_SECTOR;
+
+  journal_begin ();
+  rwlock_acquire_write (&inode->rw);
+  if (inode->deny_write_cnt) 
+    {
+      rwlock_release_write (&inode->rw);
+      journal_end ();
+      return 0;
+    }
+
+  /* Write an inline file's data in place, unless it would grow
+     too big, in which case move it to a data sector first. */
+  if (inode->data.is_inline && size > 0) 
+    {
+      if (offset + size <= INLINE_MAX) 
+        {
+          memcpy (inode->data.inline_data + offset, buffer, size);
+          bytes_written = size;
+          offset += size;
+          size = 0;
+        }
+      else if (!promote (&inode->data, metadata))
+        size = 0;
+      allocated = true;
+    }
 
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      /* Sector to write, allocating it if necessary, and
+         starting byte offset within sector. */
+      block_sector_t sector_idx = index_to_sector (&inode->data,
+                                                   offset / BLOCK_SECTOR_SIZE,
+                                                   &allocated);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left in sector, and number of bytes to actually
+         write into it. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
-
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
+      int chunk_size = size < sector_left ? size : sector_left;
+      if (sector_idx == 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      /* Copy the chunk into the buffer cache.  The cache reads
+         in the rest of the sector first if the chunk does not
+         cover all of it. */
+      if (metadata)
+        journal_log (sector_idx);
+      cache_write_at (sector_idx, buffer + bytes_written, sector_ofs,
+                      chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* Extend the file to the end of the bytes written, if any, and
+     write back the inode if it changed.  OFFSET is now just past
+     them. */
+  if (bytes_written > 0 && offset > inode->data.length) 
+    {
+      inode->data.length = offset;
+      allocated = true;
+    }
+  if (allocated) 
+    {
+      journal_log (inode->sector);
+      cache_write (inode->sector, &inode->data);
+    }
+  rwlock_release_write (&inode->rw);
+  journal_end ();
 
   return bytes_written;
 }
@@ -322,8 +581,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rw);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->rw);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +593,19 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rw);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->rw);
+}
+
+/* Returns true if INODE is a directory, false if it is an
+   ordinary file. */
+bool
+inode_is_dir (const struct inode *inode) 
+{
+  return inode->data.is_dir != 0;
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -343,3 +614,219 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Where index_to_sector() places the sectors it allocates.
+   Finding the data sector for the previous index costs a walk
+   down the file's pointer blocks, so it is only done once a hole
+   actually needs to be filled. */
+struct alloc_goal
+  {
+    struct inode_disk *data;            /* File being written. */
+    size_t idx;                         /* Sector index being looked up. */
+    bool known;                         /* Has `sector' been computed? */
+    block_sector_t sector;              /* Preferred next sector. */
+  };
+
+/* Allocates a sector, as close after GOAL as possible, and fills
+   it with zeros.  Advances GOAL past the new sector, so that a
+   run of allocations tends to be contiguous.
+   Returns the sector, or 0 if the disk is full. */
+static block_sector_t
+allocate_zeroed (struct alloc_goal *goal) 
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+
+  if (!goal->known) 
+    {
+      goal->sector = 0;
+      if (goal->idx > 0) 
+        {
+          goal->sector = index_to_sector (goal->data, goal->idx - 1, NULL);
+          if (goal->sector != 0)
+            goal->sector++;
+        }
+      goal->known = true;
+    }
+
+  if (!free_map_allocate_near (goal->sector, 1, &sector))
+    return 0;
+  cache_write (sector, zeros);
+  goal->sector = sector + 1;
+  return sector;
+}
+
+/* Returns the pointer in slot IDX of pointer block BLOCK.  If it
+   is null and GOAL is non-null, first points it at a newly
+   allocated, zeroed sector near GOAL.  Returns 0 if the pointer
+   is null and could not be filled in. */
+static block_sector_t
+block_ptr (block_sector_t block, size_t idx, struct alloc_goal *goal) 
+{
+  block_sector_t ptr;
+
+  cache_read_at (block, &ptr, idx * sizeof ptr, sizeof ptr);
+  if (ptr == 0 && goal != NULL) 
+    {
+      ptr = allocate_zeroed (goal);
+      if (ptr != 0) 
+        {
+          journal_log (block);
+          cache_write_at (block, &ptr, idx * sizeof ptr, sizeof ptr);
+        }
+    }
+  return ptr;
+}
+
+/* Like block_ptr(), but for pointer *PTR within an on-disk inode.
+   Sets *ALLOCATED to true if it allocates a sector. */
+static block_sector_t
+inode_ptr (block_sector_t *ptr, struct alloc_goal *goal, bool *allocated) 
+{
+  if (*ptr == 0 && goal != NULL) 
+    {
+      *ptr = allocate_zeroed (goal);
+      if (*ptr != 0)
+        *allocated = true;
+    }
+  return *ptr;
+}
+
+/* Returns the data sector for sector IDX of the file whose
+   on-disk inode is DATA, or 0 if it is a hole or beyond the
+   largest possible file.
+   If ALLOCATED is non-null, fills in any hole on the way to the
+   data sector, including the data sector itself, with newly
+   allocated zeroed sectors, and sets *ALLOCATED to true if DATA
+   itself changes as a result.  New sectors are placed right
+   after the data sector for IDX - 1 if possible, so that a file
+   written sequentially ends up contiguous on disk.  Returns 0 if
+   the disk fills up. */
+static block_sector_t
+index_to_sector (struct inode_disk *data, size_t idx, bool *allocated) 
+{
+  struct alloc_goal goal_;
+  struct alloc_goal *goal = NULL;
+  block_sector_t block;
+
+  if (allocated != NULL) 
+    {
+      goal_.data = data;
+      goal_.idx = idx;
+      goal_.known = false;
+      goal = &goal_;
+    }
+
+  if (idx < DIRECT_CNT)
+    return inode_ptr (&data->direct[idx], goal, allocated);
+  idx -= DIRECT_CNT;
+
+  if (idx < PTRS_PER_SECTOR) 
+    {
+      block = inode_ptr (&data->indirect, goal, allocated);
+      return block != 0 ? block_ptr (block, idx, goal) : 0;
+    }
+  idx -= PTRS_PER_SECTOR;
+
+  if (idx < PTRS_PER_SECTOR * PTRS_PER_SECTOR) 
+    {
+      block = inode_ptr (&data->dbl_indirect, goal, allocated);
+      if (block != 0)
+        block = block_ptr (block, idx / PTRS_PER_SECTOR, goal);
+      if (block != 0)
+        block = block_ptr (block, idx % PTRS_PER_SECTOR, goal);
+      return block;
+    }
+
+  return 0;
+}
+
+/* Releases SECTOR, which is LEVELS levels of pointer blocks above
+   the data, along with all the sectors it points to.  Does
+   nothing if SECTOR is null. */
+static void
+release_tree (block_sector_t sector, int levels) 
+{
+  if (sector == 0)
+    return;
+  if (levels > 0) 
+    {
+      size_t i;
+
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        release_tree (block_ptr (sector, i, NULL), levels - 1);
+    }
+  free_map_release (sector, 1);
+}
+
+/* Moves the inline data of the file whose on-disk inode is DATA
+   to a newly allocated data sector, so that the file can grow
+   past INLINE_MAX bytes.  The sector is journaled if METADATA is
+   true.  Returns true if successful, false if memory or disk
+   space runs out, in which case DATA is unchanged. */
+static bool
+promote (struct inode_disk *data, bool metadata) 
+{
+  uint8_t *copy;
+  block_sector_t sector;
+  bool allocated;
+
+  ASSERT (data->is_inline);
+
+  copy = malloc (INLINE_MAX);
+  if (copy == NULL)
+    return false;
+  memcpy (copy, data->inline_data, INLINE_MAX);
+  memset (data->inline_data, 0, INLINE_MAX);
+  data->is_inline = 0;
+
+  /* An empty file needs no data sector yet. */
+  if (data->length > 0) 
+    {
+      sector = index_to_sector (data, 0, &allocated);
+      if (sector == 0) 
+        {
+          memcpy (data->inline_data, copy, INLINE_MAX);
+          data->is_inline = 1;
+          free (copy);
+          return false;
+        }
+      if (metadata)
+        journal_log (sector);
+      cache_write_at (sector, copy, 0, INLINE_MAX);
+    }
+  free (copy);
+  return true;
+}
+
+/* Releases all the data and pointer blocks of the file whose
+   on-disk inode is DATA. */
+static void
+deallocate (struct inode_disk *data) 
+{
+  size_t i;
+
+  if (data->is_inline)
+    return;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    release_tree (data->direct[i], 0);
+  release_tree (data->indirect, 1);
+  release_tree (data->dbl_indirect, 2);
+}
+
+/* Returns a hash of inode E's sector. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Orders inodes A and B by sector. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED) 
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
@@ -0,0 +1,376 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Write-ahead journal for file system metadata.
+
+   Inodes, pointer blocks, directory blocks and the free map are
+   metadata.  Most operations change several metadata sectors at
+   once, and a crash that lets only some of the changes reach
+   disk leaves the file system inconsistent.  So each change to a
+   metadata sector is made in the buffer cache as usual, but the
+   sector is first logged with journal_log(), which adds it to
+   the running transaction and keeps the cache from writing it
+   to its home location.
+
+   journal_commit() copies the images of the transaction's
+   sectors into the journal region, then writes the journal
+   header, which lists their home sectors.  Writing the header
+   commits the whole transaction at once.  Only then may the
+   cache write the sectors home.  Once they are all there, the
+   header is cleared again.  If the system crashes before the
+   header is written, none of the transaction's changes have
+   reached their home sectors; if it crashes after, journal_init()
+   copies the images home at the next boot.  Before writing the
+   journal, a commit also writes back every dirty sector that is
+   not part of the transaction, so that the file data and newly
+   zeroed pointer blocks that committed metadata refers to are on
+   disk first.
+
+   Commits are grouped.  The transaction collects the changes of
+   every operation until the flusher's next pass, or until it is
+   nearly full, so a burst of metadata updates costs one
+   sequential journal write and one pass of home writes instead
+   of a scattered write per update.
+
+   An operation whose changes must be committed together
+   brackets them with journal_begin() and journal_end().
+   Brackets nest.  A commit waits for the operations in progress
+   to end, and holds off new ones until it is done.  Because an
+   operation that has not begun may wait for a commit, the
+   outermost journal_begin() must come before the operation
+   acquires any inode or directory lock.
+
+   The transaction never overflows.  Each operation in progress
+   has OP_MAX slots reserved for it.  Sectors it logs use them up,
+   and so does each chunk of the free map file that its
+   allocations dirty, since the commit will log that chunk: those
+   slots move to map_reserved through journal_reserve_map().  An
+   operation may use more than OP_MAX slots only while there are
+   unreserved slots left; past that, the kernel panics, since
+   writing a sector home unprotected would defeat the journal.
+   inode_write_at() splits large writes into separate operations
+   so that they stay within OP_MAX.  Released sectors dirty the
+   free map only at commit, and only as far as the slots left
+   over allow. */
+
+/* Identifies a journal header. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* Number of sector images that fit in the journal region, which
+   is a header sector followed by the images. */
+#define JOURNAL_CNT (JOURNAL_SECTORS - 1)
+
+/* Number of sectors a single operation may log.  New operations
+   wait, or commit the running transaction first, until this many
+   slots can be reserved for them. */
+#define OP_MAX 12
+
+/* On-disk journal header.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    unsigned magic;                     /* JOURNAL_MAGIC. */
+    uint32_t cnt;                       /* Images committed, 0 if none. */
+    block_sector_t home[JOURNAL_CNT];   /* Home sector of each image. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 8 - 4 * JOURNAL_CNT];
+  };
+
+static struct lock journal_lock;        /* Protects the following. */
+static struct condition op_done;        /* Signaled when an op ends. */
+static struct condition commit_done;    /* Signaled when a commit ends. */
+static int active_cnt;                  /* Operations in progress. */
+static size_t reserved;                 /* Slots reserved for them. */
+static size_t map_reserved;             /* Slots for free map chunks. */
+static struct thread *committer;        /* Thread committing, if any. */
+static block_sector_t txn[JOURNAL_CNT]; /* Sectors in the transaction. */
+static size_t txn_cnt;                  /* Number of sectors in txn. */
+static struct bitmap *held;             /* Sectors in txn, by number. */
+
+/* Used only by the committer. */
+static struct journal_header header;
+static uint8_t images[JOURNAL_CNT][BLOCK_SECTOR_SIZE];
+
+/* Statistics. */
+static unsigned long long commit_cnt;   /* Transactions committed. */
+static unsigned long long logged_cnt;   /* Sector images committed. */
+
+static size_t unreserved_slots (void);
+static void use_slot (struct thread *);
+static void write_header (size_t cnt);
+static void replay (void);
+
+/* Initializes the journal.  If FORMAT is true, starts out with
+   an empty journal; otherwise, finishes any transaction that
+   was committed but not yet written home when the system last
+   stopped.  Must be called before the buffer cache is used. */
+void
+journal_init (bool format) 
+{
+  /* If this assertion fails, the journal header is not exactly
+     one sector in size, and you should fix that. */
+  ASSERT (sizeof header == BLOCK_SECTOR_SIZE);
+
+  lock_init (&journal_lock);
+  cond_init (&op_done);
+  cond_init (&commit_done);
+  held = bitmap_create (block_size (fs_device));
+  if (held == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+
+  if (!format)
+    replay ();
+  write_header (0);
+}
+
+/* Begins an operation whose metadata changes must be committed
+   together.  Waits for any commit in progress and for OP_MAX
+   slots to be free for the operation, committing the running
+   transaction first if it is nearly full. */
+void
+journal_begin (void) 
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0 || t == committer)
+    return;
+
+  lock_acquire (&journal_lock);
+  for (;;) 
+    {
+      if (committer != NULL)
+        cond_wait (&commit_done, &journal_lock);
+      else if (unreserved_slots () >= OP_MAX)
+        break;
+      else if (active_cnt > 0)
+        cond_wait (&op_done, &journal_lock);
+      else 
+        {
+          lock_release (&journal_lock);
+          t->journal_depth--;
+          journal_commit ();
+          t->journal_depth++;
+          lock_acquire (&journal_lock);
+        }
+    }
+  active_cnt++;
+  reserved += OP_MAX;
+  t->journal_used = 0;
+  lock_release (&journal_lock);
+}
+
+/* Ends an operation begun with journal_begin(). */
+void
+journal_end (void) 
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0 || t == committer)
+    return;
+
+  lock_acquire (&journal_lock);
+  active_cnt--;
+  reserved -= OP_MAX - t->journal_used;
+  cond_broadcast (&op_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Adds SECTOR, a metadata sector that the caller is about to
+   modify in the buffer cache, to the running transaction.  Must
+   be called within an operation, before the modification.
+   Panics if the operation has used up its OP_MAX reserved slots
+   and no unreserved slot is left. */
+void
+journal_log (block_sector_t sector) 
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  if (!bitmap_test (held, sector)) 
+    {
+      if (t == committer) 
+        {
+          if (txn_cnt >= JOURNAL_CNT)
+            PANIC ("journal overflow while committing");
+        }
+      else
+        use_slot (t);
+      bitmap_mark (held, sector);
+      txn[txn_cnt++] = sector;
+    }
+  lock_release (&journal_lock);
+}
+
+/* Reserves a slot in the running transaction for each of CNT
+   free map chunks that the running operation's allocations have
+   just dirtied, which the next commit will log.  Does nothing
+   outside an operation, which happens only while formatting, and
+   in the committer, which does not allocate. */
+void
+journal_reserve_map (size_t cnt) 
+{
+  struct thread *t = thread_current ();
+
+  if (cnt == 0 || t->journal_depth == 0 || t == committer)
+    return;
+
+  lock_acquire (&journal_lock);
+  for (; cnt > 0; cnt--) 
+    {
+      use_slot (t);
+      map_reserved++;
+    }
+  lock_release (&journal_lock);
+}
+
+/* Returns true if SECTOR is part of the running transaction, in
+   which case the buffer cache must not write it home.
+
+   Called by the cache with its own locks held, so it does not
+   take journal_lock.  A sector only joins the transaction before
+   it is modified and only leaves it once no operation is in
+   progress, so a stale answer is harmless. */
+bool
+journal_holds (block_sector_t sector) 
+{
+  return (held != NULL && sector < bitmap_size (held)
+          && bitmap_test (held, sector));
+}
+
+/* Commits the running transaction, then writes back every dirty
+   sector in the buffer cache.  Called periodically by the
+   flusher and at shutdown.  Must not be called within an
+   operation. */
+void
+journal_commit (void) 
+{
+  struct thread *t = thread_current ();
+  size_t i;
+
+  ASSERT (t->journal_depth == 0);
+
+  /* Become the committer and wait for operations to end. */
+  lock_acquire (&journal_lock);
+  while (committer != NULL)
+    cond_wait (&commit_done, &journal_lock);
+  committer = t;
+  while (active_cnt > 0)
+    cond_wait (&op_done, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* The free map changes in memory, so bring it up to date on
+     disk as part of the transaction, freeing as many released
+     sectors as the slots no chunk has reserved allow.  No
+     operation can allocate one of them before this commit is
+     done. */
+  free_map_sync (JOURNAL_CNT - txn_cnt - map_reserved);
+  map_reserved = 0;
+
+  if (txn_cnt > 0) 
+    {
+      /* Write everything the transaction refers to, then the
+         images, then the header that commits them. */
+      cache_flush ();
+      for (i = 0; i < txn_cnt; i++)
+        cache_read (txn[i], images[i]);
+      block_write_multiple (fs_device, JOURNAL_SECTOR + 1, images, txn_cnt);
+      memcpy (header.home, txn, txn_cnt * sizeof *txn);
+      write_header (txn_cnt);
+      commit_cnt++;
+      logged_cnt += txn_cnt;
+
+      /* Checkpoint: write the images home, then retire them. */
+      for (i = 0; i < txn_cnt; i++)
+        bitmap_reset (held, txn[i]);
+      cache_flush ();
+      write_header (0);
+      txn_cnt = 0;
+    }
+  else
+    cache_flush ();
+
+  lock_acquire (&journal_lock);
+  committer = NULL;
+  cond_broadcast (&commit_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void) 
+{
+  printf ("Journal: %llu commits, %llu sectors logged\n",
+          commit_cnt, logged_cnt);
+}
+
+/* Returns the number of slots in the running transaction that
+   are neither used nor reserved for an operation in progress or
+   for the free map.  journal_lock must be held. */
+static size_t
+unreserved_slots (void) 
+{
+  size_t used = txn_cnt + reserved + map_reserved;
+
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+
+  return used < JOURNAL_CNT ? JOURNAL_CNT - used : 0;
+}
+
+/* Writes the journal header, with CNT committed images whose
+   home sectors are in header.home. */
+static void
+write_header (size_t cnt) 
+{
+  header.magic = JOURNAL_MAGIC;
+  header.cnt = cnt;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Copies the images of a committed transaction, if the journal
+   holds one, to their home sectors. */
+static void
+replay (void) 
+{
+  size_t i;
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC || header.cnt == 0)
+    return;
+  if (header.cnt > JOURNAL_CNT)
+    PANIC ("journal header is corrupt");
+
+  printf ("Replaying journal (%u sectors)...", (unsigned) header.cnt);
+  block_read_multiple (fs_device, JOURNAL_SECTOR + 1, images, header.cnt);
+  for (i = 0; i < header.cnt; i++)
+    block_write (fs_device, header.home[i], images[i]);
+  printf ("done.\n");
+}
+
+/* Takes a slot in the running transaction for running operation
+   T: one of those reserved for it, if it has any left, otherwise
+   an unreserved one.  Panics if there is none.  journal_lock
+   must be held. */
+static void
+use_slot (struct thread *t) 
+{
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+
+  if (t->journal_used < OP_MAX) 
+    {
+      t->journal_used++;
+      reserved--;
+    }
+  else if (unreserved_slots () == 0)
+    PANIC ("file system operation used more than %d journal slots",
+           OP_MAX);
+}
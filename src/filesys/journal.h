@@ -0,0 +1,16 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+void journal_init (bool format);
+void journal_begin (void);
+void journal_end (void);
+void journal_log (block_sector_t);
+void journal_reserve_map (size_t cnt);
+bool journal_holds (block_sector_t);
+void journal_commit (void);
+void journal_print_stats (void);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,44 @@
+#ifndef __LIB_IOSTAT_H
+#define __LIB_IOSTAT_H
+
+#include <stdint.h>
+
+/* I/O statistics for a block device.  The kernel keeps one for
+   each device, prints them with the "iostat" action, and copies
+   them out to user programs with the iostat() system call.
+
+   Times are in CPU timestamp counter cycles.  Each histogram
+   counts requests by the base-2 logarithm of a time: bucket 0
+   counts times under 2**(IOSTAT_MIN_SHIFT + 1) cycles, bucket
+   I counts times from 2**(IOSTAT_MIN_SHIFT + I) cycles up to
+   twice that, and the last bucket also counts everything
+   longer. */
+#define IOSTAT_BUCKETS 20
+#define IOSTAT_MIN_SHIFT 10
+
+struct iostat
+  {
+    /* Completed requests. */
+    uint64_t read_cnt;                  /* Read requests. */
+    uint64_t write_cnt;                 /* Write requests. */
+    uint64_t read_bytes;                /* Bytes read. */
+    uint64_t write_bytes;               /* Bytes written. */
+    uint64_t merge_cnt;                 /* Requests merged by the driver
+                                           into another's transfer. */
+
+    /* Queue depth: requests submitted but not yet completed. */
+    uint32_t depth;                     /* Current depth. */
+    uint32_t max_depth;                 /* Highest depth seen. */
+    uint64_t depth_sum;                 /* Sum of the depth seen by each
+                                           request on submission. */
+    uint64_t submit_cnt;                /* Requests submitted. */
+
+    /* Queue wait, from submission until the driver starts the
+       transfer, and service time, from then until completion. */
+    uint64_t wait_cycles;               /* Total queue wait. */
+    uint64_t service_cycles;            /* Total service time. */
+    uint64_t wait_hist[IOSTAT_BUCKETS];
+    uint64_t service_hist[IOSTAT_BUCKETS];
+  };
+
+#endif /* lib/iostat.h */
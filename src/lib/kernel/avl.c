@@ -0,0 +1,238 @@
+/* Balanced binary search tree.
+
+   See avl.h for basic information. */
+
+#include "avl.h"
+#include "../debug.h"
+
+static struct avl_elem *insert_elem (struct avl *, struct avl_elem *root,
+                                     struct avl_elem *);
+static struct avl_elem *delete_elem (struct avl *, struct avl_elem *root,
+                                     struct avl_elem *);
+static struct avl_elem *delete_min (struct avl_elem *root,
+                                    struct avl_elem **min);
+static struct avl_elem *rebalance (struct avl_elem *);
+
+/* Initializes tree T to compare elements using LESS, given
+   auxiliary data AUX. */
+void
+avl_init (struct avl *t, avl_less_func *less, void *aux) 
+{
+  t->root = NULL;
+  t->elem_cnt = 0;
+  t->less = less;
+  t->aux = aux;
+}
+
+/* Inserts NEW into tree T.  No element equal to NEW may already
+   be in T. */
+void
+avl_insert (struct avl *t, struct avl_elem *new) 
+{
+  t->root = insert_elem (t, t->root, new);
+  t->elem_cnt++;
+}
+
+/* Removes E, which must be in tree T, from T. */
+void
+avl_delete (struct avl *t, struct avl_elem *e) 
+{
+  t->root = delete_elem (t, t->root, e);
+  t->elem_cnt--;
+}
+
+/* Returns the least element in T, or a null pointer if T is
+   empty. */
+struct avl_elem *
+avl_min (const struct avl *t) 
+{
+  struct avl_elem *e = t->root;
+
+  if (e != NULL)
+    while (e->left != NULL)
+      e = e->left;
+  return e;
+}
+
+/* Returns the greatest element in T that is less than or equal
+   to KEY, or a null pointer if there is none. */
+struct avl_elem *
+avl_floor (const struct avl *t, const struct avl_elem *key) 
+{
+  struct avl_elem *e = t->root;
+  struct avl_elem *best = NULL;
+
+  while (e != NULL)
+    if (t->less (key, e, t->aux))
+      e = e->left;
+    else 
+      {
+        best = e;
+        e = e->right;
+      }
+  return best;
+}
+
+/* Returns the least element in T that is greater than or equal
+   to KEY, or a null pointer if there is none. */
+struct avl_elem *
+avl_ceiling (const struct avl *t, const struct avl_elem *key) 
+{
+  struct avl_elem *e = t->root;
+  struct avl_elem *best = NULL;
+
+  while (e != NULL)
+    if (t->less (e, key, t->aux))
+      e = e->right;
+    else 
+      {
+        best = e;
+        e = e->left;
+      }
+  return best;
+}
+
+/* Returns the number of elements in T. */
+size_t
+avl_size (const struct avl *t) 
+{
+  return t->elem_cnt;
+}
+
+/* Returns true if T contains no elements, false otherwise. */
+bool
+avl_empty (const struct avl *t) 
+{
+  return t->elem_cnt == 0;
+}
+
+/* Returns the height of the subtree rooted at E. */
+static int
+height (const struct avl_elem *e) 
+{
+  return e != NULL ? e->height : 0;
+}
+
+/* Recomputes E's height from those of its children. */
+static void
+update_height (struct avl_elem *e) 
+{
+  int left = height (e->left);
+  int right = height (e->right);
+  e->height = (left > right ? left : right) + 1;
+}
+
+/* Rotates the subtree rooted at E to the right and returns its
+   new root. */
+static struct avl_elem *
+rotate_right (struct avl_elem *e) 
+{
+  struct avl_elem *root = e->left;
+
+  e->left = root->right;
+  root->right = e;
+  update_height (e);
+  update_height (root);
+  return root;
+}
+
+/* Rotates the subtree rooted at E to the left and returns its
+   new root. */
+static struct avl_elem *
+rotate_left (struct avl_elem *e) 
+{
+  struct avl_elem *root = e->right;
+
+  e->right = root->left;
+  root->left = e;
+  update_height (e);
+  update_height (root);
+  return root;
+}
+
+/* Restores the balance of the subtree rooted at E, whose
+   children are balanced and differ in height by at most two.
+   Returns the subtree's new root. */
+static struct avl_elem *
+rebalance (struct avl_elem *e) 
+{
+  int balance = height (e->left) - height (e->right);
+
+  if (balance > 1) 
+    {
+      if (height (e->left->left) < height (e->left->right))
+        e->left = rotate_left (e->left);
+      return rotate_right (e);
+    }
+  else if (balance < -1) 
+    {
+      if (height (e->right->right) < height (e->right->left))
+        e->right = rotate_right (e->right);
+      return rotate_left (e);
+    }
+  update_height (e);
+  return e;
+}
+
+/* Inserts NEW into the subtree of T rooted at ROOT and returns
+   the subtree's new root. */
+static struct avl_elem *
+insert_elem (struct avl *t, struct avl_elem *root, struct avl_elem *new) 
+{
+  if (root == NULL) 
+    {
+      new->left = new->right = NULL;
+      new->height = 1;
+      return new;
+    }
+
+  if (t->less (new, root, t->aux))
+    root->left = insert_elem (t, root->left, new);
+  else 
+    {
+      ASSERT (t->less (root, new, t->aux));
+      root->right = insert_elem (t, root->right, new);
+    }
+  return rebalance (root);
+}
+
+/* Removes E from the subtree of T rooted at ROOT and returns the
+   subtree's new root. */
+static struct avl_elem *
+delete_elem (struct avl *t, struct avl_elem *root, struct avl_elem *e) 
+{
+  ASSERT (root != NULL);
+
+  if (t->less (e, root, t->aux))
+    root->left = delete_elem (t, root->left, e);
+  else if (t->less (root, e, t->aux))
+    root->right = delete_elem (t, root->right, e);
+  else 
+    {
+      struct avl_elem *right;
+
+      ASSERT (root == e);
+      if (e->right == NULL)
+        return e->left;
+
+      /* Replace E by its successor. */
+      right = delete_min (e->right, &root);
+      root->left = e->left;
+      root->right = right;
+    }
+  return rebalance (root);
+}
+
+/* Removes the least element from the subtree rooted at ROOT,
+   stores it in *MIN, and returns the subtree's new root. */
+static struct avl_elem *
+delete_min (struct avl_elem *root, struct avl_elem **min) 
+{
+  if (root->left == NULL) 
+    {
+      *min = root;
+      return root->right;
+    }
+  root->left = delete_min (root->left, min);
+  return rebalance (root);
+}
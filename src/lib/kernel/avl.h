@@ -0,0 +1,73 @@
+#ifndef __LIB_KERNEL_AVL_H
+#define __LIB_KERNEL_AVL_H
+
+/* Balanced binary search tree.
+
+   An AVL tree keeps its elements sorted according to a
+   comparison function, and keeps the heights of the two subtrees
+   of every node within one of each other.  Searching, inserting,
+   and deleting all take O(lg n) time.
+
+   Like lists and hash tables, the tree does not use dynamic
+   allocation.  Each structure that can potentially be in a tree
+   must embed a struct avl_elem member, and the avl_entry macro
+   converts from a struct avl_elem back to a structure object
+   that contains it.  Refer to lib/kernel/list.h for a detailed
+   explanation of the technique.
+
+   No two elements in a tree may compare equal.  A structure may
+   be in more than one tree at a time by embedding more than one
+   struct avl_elem, each ordered by its own comparison function. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tree element. */
+struct avl_elem 
+  {
+    struct avl_elem *left;      /* Subtree of lesser elements. */
+    struct avl_elem *right;     /* Subtree of greater elements. */
+    int height;                 /* Height of subtree rooted here. */
+  };
+
+/* Converts pointer to tree element AVL_ELEM into a pointer to
+   the structure that AVL_ELEM is embedded inside.  Supply the
+   name of the outer structure STRUCT and the member name MEMBER
+   of the tree element. */
+#define avl_entry(AVL_ELEM, STRUCT, MEMBER)                     \
+        ((STRUCT *) ((uint8_t *) &(AVL_ELEM)->left              \
+                     - offsetof (STRUCT, MEMBER.left)))
+
+/* Compares the value of two tree elements A and B, given
+   auxiliary data AUX.  Returns true if A is less than B, or
+   false if A is greater than or equal to B. */
+typedef bool avl_less_func (const struct avl_elem *a,
+                            const struct avl_elem *b,
+                            void *aux);
+
+/* Tree. */
+struct avl 
+  {
+    struct avl_elem *root;      /* Root element, or null if empty. */
+    size_t elem_cnt;            /* Number of elements in tree. */
+    avl_less_func *less;        /* Comparison function. */
+    void *aux;                  /* Auxiliary data for `less'. */
+  };
+
+void avl_init (struct avl *, avl_less_func *, void *aux);
+
+/* Insertion, deletion. */
+void avl_insert (struct avl *, struct avl_elem *);
+void avl_delete (struct avl *, struct avl_elem *);
+
+/* Search. */
+struct avl_elem *avl_min (const struct avl *);
+struct avl_elem *avl_floor (const struct avl *, const struct avl_elem *);
+struct avl_elem *avl_ceiling (const struct avl *, const struct avl_elem *);
+
+/* Information. */
+size_t avl_size (const struct avl *);
+bool avl_empty (const struct avl *);
+
+#endif /* lib/kernel/avl.h */
@@ -356,8 +356,25 @@ bitmap_read (struct bitmap *b, struct file *file)
 bool
 bitmap_write (const struct bitmap *b, struct file *file)
 {
-  off_t size = byte_cnt (b->bit_cnt);
-  return file_write_at (file, b->bits, size, 0) == size;
+  return bitmap_write_part (b, file, 0, byte_cnt (b->bit_cnt));
+}
+
+/* Writes the SIZE bytes of B that start at byte offset OFS in
+   its file representation to the same offset in FILE, stopping
+   at the end of B.  Return true if successful, false
+   otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   size_t ofs, size_t size) 
+{
+  size_t file_size = byte_cnt (b->bit_cnt);
+
+  if (ofs >= file_size)
+    return true;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  return (file_write_at (file, (uint8_t *) b->bits + ofs, size, ofs)
+          == (off_t) size);
 }
 #endif /* FILESYS */
 
@@ -45,4 +45,8 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Extensions. */
+struct iostat;
+bool iostat (const char *device, struct iostat *);
+
 #endif /* lib/user/syscall.h */
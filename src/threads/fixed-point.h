@@ -0,0 +1,104 @@
+#ifndef THREADS_FIXED_POINT_H
+#define THREADS_FIXED_POINT_H
+
+#include <stdint.h>
+
+/* Signed 17.14 fixed-point arithmetic.
+
+   A fixed_point_t holds a real number X as the integer
+   X * 2**14, so the low 14 bits are the fraction and the
+   remaining 17 bits (plus sign) are the integer part, giving a
+   range of about +/-131,071.  The kernel has no floating-point
+   support, so the MLFQS scheduler does its arithmetic with these
+   functions.
+
+   Functions with an `_int' suffix take an ordinary integer as
+   their second operand.  Multiplication and division of two
+   fixed-point numbers go through a 64-bit intermediate to avoid
+   overflow. */
+typedef int32_t fixed_point_t;
+
+/* Number of fraction bits. */
+#define FP_SHIFT 14
+
+/* The fixed-point representation of 1. */
+#define FP_ONE (1 << FP_SHIFT)
+
+/* Converts integer N to fixed point. */
+static inline fixed_point_t
+fp_int (int n)
+{
+  return n * FP_ONE;
+}
+
+/* Converts X to an integer, rounding toward zero. */
+static inline int
+fp_trunc (fixed_point_t x)
+{
+  return x / FP_ONE;
+}
+
+/* Converts X to an integer, rounding to nearest. */
+static inline int
+fp_round (fixed_point_t x)
+{
+  return (x >= 0 ? x + FP_ONE / 2 : x - FP_ONE / 2) / FP_ONE;
+}
+
+/* Returns X + Y. */
+static inline fixed_point_t
+fp_add (fixed_point_t x, fixed_point_t y)
+{
+  return x + y;
+}
+
+/* Returns X - Y. */
+static inline fixed_point_t
+fp_sub (fixed_point_t x, fixed_point_t y)
+{
+  return x - y;
+}
+
+/* Returns X + N. */
+static inline fixed_point_t
+fp_add_int (fixed_point_t x, int n)
+{
+  return x + n * FP_ONE;
+}
+
+/* Returns X - N. */
+static inline fixed_point_t
+fp_sub_int (fixed_point_t x, int n)
+{
+  return x - n * FP_ONE;
+}
+
+/* Returns X * Y. */
+static inline fixed_point_t
+fp_mul (fixed_point_t x, fixed_point_t y)
+{
+  return (int64_t) x * y / FP_ONE;
+}
+
+/* Returns X * N. */
+static inline fixed_point_t
+fp_mul_int (fixed_point_t x, int n)
+{
+  return x * n;
+}
+
+/* Returns X / Y. */
+static inline fixed_point_t
+fp_div (fixed_point_t x, fixed_point_t y)
+{
+  return (int64_t) x * FP_ONE / y;
+}
+
+/* Returns X / N. */
+static inline fixed_point_t
+fp_div_int (fixed_point_t x, int n)
+{
+  return x / n;
+}
+
+#endif /* threads/fixed-point.h */
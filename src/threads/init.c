@@ -34,7 +34,9 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
 #include "filesys/filesys.h"
+#include "filesys/fsbench.h"
 #include "filesys/fsutil.h"
 #endif
 
@@ -123,6 +125,7 @@ main (void)
 #ifdef FILESYS
   /* Initialize file system. */
   ide_init ();
+  ramdisk_init ();
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -247,6 +250,10 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-pio"))
+        ide_pio_only = true;
+      else if (!strcmp (name, "-ramdisk"))
+        ramdisk_kb = atoi (value);
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -292,6 +299,16 @@ run_task (char **argv)
   printf ("Execution of '%s' complete.\n", task);
 }
 
+#ifdef FILESYS
+/* Prints I/O statistics for every block device and disk. */
+static void
+run_iostat (char **argv UNUSED)
+{
+  block_print_iostat ();
+  ide_print_stats ();
+}
+#endif
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -315,6 +332,8 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"bench", 2, fsbench_run},
+      {"iostat", 1, run_iostat},
 #endif
       {NULL, 0, NULL},
     };
@@ -361,6 +380,8 @@ usage (void)
           "  ls                 List files in the root directory.\n"
           "  cat FILE           Print FILE to the console.\n"
           "  rm FILE            Delete FILE.\n"
+          "  bench NAME         Run file system benchmark NAME.\n"
+          "  iostat             Print block device I/O statistics.\n"
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
@@ -373,6 +394,9 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -pio               Transfer IDE disk data without DMA.\n"
+          "  -ramdisk=KB        Create RAM disk ram0 of KB kB, for use\n"
+          "                     with -filesys, -scratch, or -swap.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -7,27 +7,46 @@
 #include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
+#include "threads/io.h"
 #include "threads/palloc.h"
 #include "threads/switch.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #endif
+#ifdef FILESYS
+#include "filesys/directory.h"
+#endif
 
 /* Random value for struct thread's `magic' member.
    Used to detect stack overflow.  See the big comment at the top
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Number of distinct thread priorities. */
+#define PRI_CNT (PRI_MAX - PRI_MIN + 1)
+
+/* Run queue of processes in THREAD_READY state, that is,
+   processes that are ready to run but not actually running.
+   There is one FIFO list per priority.  Bit P of ready_mask is
+   set if and only if ready_lists[P - PRI_MIN] is nonempty, so
+   the highest-priority ready thread can be found with a single
+   bit scan no matter how many threads are runnable. */
+static struct list ready_lists[PRI_CNT];
+static uint64_t ready_mask;
+
+/* Number of threads in the run queue. */
+static int ready_cnt;
 
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
 static struct list all_list;
 
+/* Number of threads in all_list. */
+static int thread_cnt;
+
 /* Idle thread. */
 static struct thread *idle_thread;
 
@@ -59,17 +78,59 @@ static unsigned thread_ticks;   /* # of timer ticks since last yield. */
    Controlled by kernel command-line option "-o mlfqs". */
 bool thread_mlfqs;
 
+/* Multi-level feedback queue scheduler.
+
+   Every thread's recent_cpu decays once per second by the same
+   coefficient, which depends only on load_avg.  Running and
+   ready threads are decayed eagerly at each second boundary,
+   but blocked threads, which may number in the thousands, are
+   decayed lazily so that the timer interrupt never walks
+   all_list: each thread records in `mlfqs_epoch' the second its
+   recent_cpu is current as of, and mlfqs_catch_up() applies the
+   coefficients it missed from decay_history when the thread is
+   unblocked.  A blocked thread's priority depends only on its
+   recent_cpu and nice, so this yields the same priorities as
+   eager recomputation.
+
+   To bound how far behind a thread can fall, mlfqs_sweep()
+   catches up a few blocked threads on every tick, enough to
+   cover all_list every MLFQS_SWEEP_SECS seconds, which must be
+   comfortably less than MLFQS_HISTORY. */
+#define MLFQS_HISTORY 16        /* Seconds of decay coefficients kept. */
+#define MLFQS_SWEEP_SECS 4      /* Seconds per sweep of all_list. */
+#define MLFQS_PRI_TICKS 4       /* Ticks between priority updates. */
+static fixed_point_t load_avg;  /* System load average. */
+static int mlfqs_epoch;         /* Seconds since MLFQS started. */
+static fixed_point_t decay_history[MLFQS_HISTORY]; /* Coefficients. */
+static struct list_elem *sweep_cursor; /* Next thread to sweep. */
+
+/* MLFQS statistics. */
+static long long mlfqs_ticks;      /* # of ticks with MLFQS updates. */
+static long long mlfqs_cycles;     /* CPU cycles spent in updates. */
+static long long mlfqs_max_cycles; /* Most cycles spent in one tick. */
+
 static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
 static struct thread *running_thread (void);
 static struct thread *next_thread_to_run (void);
+static void ready_push (struct thread *);
+static struct thread *ready_pop (void);
+static void ready_remove (struct thread *);
+static void set_priority (struct thread *, int);
+static int ready_max_priority (void);
+static int highest_bit (uint64_t);
 static void init_thread (struct thread *, const char *name, int priority);
 static bool is_thread (struct thread *) UNUSED;
 static void *alloc_frame (struct thread *, size_t size);
 static void schedule (void);
 void thread_schedule_tail (struct thread *prev);
 static tid_t allocate_tid (void);
+static void mlfqs_tick (struct thread *);
+static void mlfqs_second (void);
+static void mlfqs_sweep (void);
+static void mlfqs_catch_up (struct thread *);
+static void mlfqs_update_priority (struct thread *);
 
 /* Initializes the threading system by transforming the code
    that's currently running into a thread.  This can't work in
@@ -87,11 +148,16 @@ static tid_t allocate_tid (void);
 void
 thread_init (void) 
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
+  for (i = 0; i < PRI_CNT; i++)
+    list_init (&ready_lists[i]);
+  ready_mask = 0;
   list_init (&all_list);
+  sweep_cursor = list_end (&all_list);
 
   /* Set up a thread structure for the running thread. */
   initial_thread = running_thread ();
@@ -134,6 +200,20 @@ thread_tick (void)
   else
     kernel_ticks++;
 
+  /* Update MLFQS bookkeeping, timing how long it takes. */
+  if (thread_mlfqs) 
+    {
+      uint64_t start = rdtsc ();
+      long long cycles;
+
+      mlfqs_tick (t);
+      cycles = rdtsc () - start;
+      mlfqs_ticks++;
+      mlfqs_cycles += cycles;
+      if (cycles > mlfqs_max_cycles)
+        mlfqs_max_cycles = cycles;
+    }
+
   /* Enforce preemption. */
   if (++thread_ticks >= TIME_SLICE)
     intr_yield_on_return ();
@@ -145,6 +225,9 @@ thread_print_stats (void)
 {
   printf ("Thread: %lld idle ticks, %lld kernel ticks, %lld user ticks\n",
           idle_ticks, kernel_ticks, user_ticks);
+  if (thread_mlfqs && mlfqs_ticks > 0)
+    printf ("MLFQS: %lld cycles/tick average, %lld cycles/tick max\n",
+            mlfqs_cycles / mlfqs_ticks, mlfqs_max_cycles);
 }
 
 /* Creates a new kernel thread named NAME with the given initial
@@ -159,9 +242,11 @@ thread_print_stats (void)
    scheduled.  Use a semaphore or some other form of
    synchronization if you need to ensure ordering.
 
-   The code provided sets the new thread's `priority' member to
-   PRIORITY, but no actual priority scheduling is implemented.
-   Priority scheduling is the goal of Problem 1-3. */
+   If the new thread has a higher priority than the running
+   thread, the running thread yields to it immediately.  Under
+   the MLFQS scheduler, PRIORITY is ignored: the new thread
+   inherits the running thread's nice and recent_cpu values and
+   its priority is computed from them. */
 tid_t
 thread_create (const char *name, int priority,
                thread_func *function, void *aux) 
@@ -183,6 +268,11 @@ thread_create (const char *name, int priority,
   /* Initialize thread. */
   init_thread (t, name, priority);
   tid = t->tid = allocate_tid ();
+#ifdef FILESYS
+  /* Start in the creator's current directory. */
+  if (thread_current ()->cwd != NULL)
+    t->cwd = dir_reopen (thread_current ()->cwd);
+#endif
 
   /* Prepare thread for first run by initializing its stack.
      Do this atomically so intermediate values for the 'stack' 
@@ -208,6 +298,7 @@ thread_create (const char *name, int priority,
 
   /* Add to run queue. */
   thread_unblock (t);
+  thread_yield_to_higher ();
 
   return tid;
 }
@@ -235,7 +326,8 @@ thread_block (void)
    This function does not preempt the running thread.  This can
    be important: if the caller had disabled interrupts itself,
    it may expect that it can atomically unblock a thread and
-   update other data. */
+   update other data.  Call thread_yield_to_higher() afterward
+   if T should be allowed to preempt the running thread. */
 void
 thread_unblock (struct thread *t) 
 {
@@ -245,7 +337,9 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_push_back (&ready_list, &t->elem);
+  if (thread_mlfqs)
+    mlfqs_catch_up (t);
+  ready_push (t);
   t->status = THREAD_READY;
   intr_set_level (old_level);
 }
@@ -293,12 +387,18 @@ thread_exit (void)
 #ifdef USERPROG
   process_exit ();
 #endif
+#ifdef FILESYS
+  dir_close (thread_current ()->cwd);
+#endif
 
   /* Remove thread from all threads list, set our status to dying,
      and schedule another process.  That process will destroy us
      when it calls thread_schedule_tail(). */
   intr_disable ();
+  if (sweep_cursor == &thread_current ()->allelem)
+    sweep_cursor = list_next (sweep_cursor);
   list_remove (&thread_current()->allelem);
+  thread_cnt--;
   thread_current ()->status = THREAD_DYING;
   schedule ();
   NOT_REACHED ();
@@ -316,12 +416,33 @@ thread_yield (void)
 
   old_level = intr_disable ();
   if (cur != idle_thread) 
-    list_push_back (&ready_list, &cur->elem);
+    ready_push (cur);
   cur->status = THREAD_READY;
   schedule ();
   intr_set_level (old_level);
 }
 
+/* Yields the CPU if some ready thread has a higher priority than
+   the running thread.  In an external interrupt context, the
+   yield is deferred until the interrupt returns. */
+void
+thread_yield_to_higher (void) 
+{
+  enum intr_level old_level = intr_disable ();
+  struct thread *cur = running_thread ();
+  bool preempt = (cur == idle_thread ? ready_mask != 0
+                  : ready_max_priority () > cur->priority);
+
+  intr_set_level (old_level);
+  if (preempt) 
+    {
+      if (intr_context ())
+        intr_yield_on_return ();
+      else
+        thread_yield ();
+    }
+}
+
 /* Invoke function 'func' on all threads, passing along 'aux'.
    This function must be called with interrupts off. */
 void
@@ -339,11 +460,89 @@ thread_foreach (thread_action_func *func, void *aux)
     }
 }
 
-/* Sets the current thread's priority to NEW_PRIORITY. */
+/* Sets the current thread's base priority to NEW_PRIORITY.  The
+   thread keeps any higher priority donated to it until it
+   releases the locks involved.  Yields if the running thread no
+   longer has the highest priority.  Ignored under the MLFQS
+   scheduler, which sets priorities itself. */
 void
 thread_set_priority (int new_priority) 
 {
-  thread_current ()->priority = new_priority;
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  ASSERT (PRI_MIN <= new_priority && new_priority <= PRI_MAX);
+
+  if (thread_mlfqs)
+    return;
+
+  old_level = intr_disable ();
+  cur->base_priority = new_priority;
+  thread_update_priority (cur);
+  intr_set_level (old_level);
+  thread_yield_to_higher ();
+}
+
+/* Raises T's priority to PRIORITY, if it is lower, on behalf of
+   a thread waiting for a lock that T holds.  Interrupts must be
+   off. */
+void
+thread_donate_priority (struct thread *t, int priority) 
+{
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!thread_mlfqs && t->priority < priority)
+    set_priority (t, priority);
+}
+
+/* Recomputes T's priority as the higher of its base priority and
+   the priorities of the threads waiting for locks that T holds.
+   Interrupts must be off. */
+void
+thread_update_priority (struct thread *t) 
+{
+  int priority;
+  struct list_elem *e, *f;
+
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (thread_mlfqs)
+    return;
+
+  priority = t->base_priority;
+  for (e = list_begin (&t->locks); e != list_end (&t->locks);
+       e = list_next (e))
+    {
+      struct list *waiters = &list_entry (e, struct lock, elem)
+                               ->semaphore.waiters;
+
+      for (f = list_begin (waiters); f != list_end (waiters);
+           f = list_next (f))
+        {
+          struct thread *waiter = list_entry (f, struct thread, elem);
+          if (waiter->priority > priority)
+            priority = waiter->priority;
+        }
+    }
+  if (priority != t->priority)
+    set_priority (t, priority);
+}
+
+/* Sets T's priority to PRIORITY, moving T to the proper run
+   queue list if it is ready to run. */
+static void
+set_priority (struct thread *t, int priority) 
+{
+  if (t->status == THREAD_READY && t != idle_thread) 
+    {
+      ready_remove (t);
+      t->priority = priority;
+      ready_push (t);
+    }
+  else
+    t->priority = priority;
 }
 
 /* Returns the current thread's priority. */
@@ -353,35 +552,178 @@ thread_get_priority (void)
   return thread_current ()->priority;
 }
 
-/* Sets the current thread's nice value to NICE. */
+/* Sets the current thread's nice value to NICE and recomputes
+   its priority, yielding if it no longer has the highest
+   priority. */
 void
-thread_set_nice (int nice UNUSED) 
+thread_set_nice (int nice) 
 {
-  /* Not yet implemented. */
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  ASSERT (NICE_MIN <= nice && nice <= NICE_MAX);
+
+  old_level = intr_disable ();
+  cur->nice = nice;
+  if (thread_mlfqs)
+    mlfqs_update_priority (cur);
+  intr_set_level (old_level);
+  thread_yield_to_higher ();
 }
 
 /* Returns the current thread's nice value. */
 int
 thread_get_nice (void) 
 {
-  /* Not yet implemented. */
-  return 0;
+  return thread_current ()->nice;
 }
 
 /* Returns 100 times the system load average. */
 int
 thread_get_load_avg (void) 
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int load_avg_100 = fp_round (fp_mul_int (load_avg, 100));
+  intr_set_level (old_level);
+
+  return load_avg_100;
 }
 
 /* Returns 100 times the current thread's recent_cpu value. */
 int
 thread_get_recent_cpu (void) 
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int recent_cpu_100 = fp_round (fp_mul_int (thread_current ()->recent_cpu,
+                                             100));
+  intr_set_level (old_level);
+
+  return recent_cpu_100;
+}
+
+/* Performs the per-tick MLFQS updates for CUR, the running
+   thread.  Runs in the timer interrupt handler. */
+static void
+mlfqs_tick (struct thread *cur) 
+{
+  int64_t now = timer_ticks ();
+
+  if (cur != idle_thread)
+    cur->recent_cpu = fp_add_int (cur->recent_cpu, 1);
+
+  if (now % TIMER_FREQ == 0)
+    mlfqs_second ();
+
+  /* Between second boundaries, only the running thread's
+     recent_cpu changes, so only its priority needs updating. */
+  if (now % MLFQS_PRI_TICKS == 0 && cur != idle_thread) 
+    {
+      mlfqs_update_priority (cur);
+      if (ready_max_priority () > cur->priority)
+        intr_yield_on_return ();
+    }
+
+  mlfqs_sweep ();
+}
+
+/* Performs the once-per-second MLFQS updates: recomputes
+   load_avg, records the new recent_cpu decay coefficient, and
+   applies it to the running thread and every ready thread,
+   moving ready threads whose priority changed to the proper
+   run queue list. */
+static void
+mlfqs_second (void) 
+{
+  struct thread *cur = running_thread ();
+  struct list requeue;
+  fixed_point_t twice_load;
+  int ready_threads;
+
+  ready_threads = ready_cnt + (cur != idle_thread);
+  load_avg = fp_add (fp_div_int (fp_mul_int (load_avg, 59), 60),
+                     fp_div_int (fp_int (ready_threads), 60));
+
+  twice_load = fp_mul_int (load_avg, 2);
+  mlfqs_epoch++;
+  decay_history[mlfqs_epoch % MLFQS_HISTORY]
+    = fp_div (twice_load, fp_add_int (twice_load, 1));
+
+  if (cur != idle_thread)
+    mlfqs_catch_up (cur);
+
+  /* Drain the run queue in priority order, then refill it, so
+     that threads keep their relative order within each list. */
+  list_init (&requeue);
+  while (ready_mask != 0)
+    list_push_back (&requeue, &ready_pop ()->elem);
+  while (!list_empty (&requeue)) 
+    {
+      struct thread *t = list_entry (list_pop_front (&requeue),
+                                     struct thread, elem);
+      mlfqs_catch_up (t);
+      ready_push (t);
+    }
+}
+
+/* Catches up a handful of blocked threads, continuing where the
+   previous call left off, so that no thread falls more than
+   about MLFQS_SWEEP_SECS seconds behind. */
+static void
+mlfqs_sweep (void) 
+{
+  int budget = thread_cnt / (TIMER_FREQ * MLFQS_SWEEP_SECS) + 1;
+
+  while (budget-- > 0) 
+    {
+      struct thread *t;
+
+      if (sweep_cursor == list_end (&all_list))
+        sweep_cursor = list_begin (&all_list);
+      t = list_entry (sweep_cursor, struct thread, allelem);
+      sweep_cursor = list_next (sweep_cursor);
+
+      if (t->status == THREAD_BLOCKED && t != idle_thread)
+        mlfqs_catch_up (t);
+    }
+}
+
+/* Brings T's recent_cpu up to date by applying each per-second
+   decay it has missed, then recomputes its priority.  T must not
+   be in the run queue, because its priority may change.
+   Interrupts must be off. */
+static void
+mlfqs_catch_up (struct thread *t) 
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (mlfqs_epoch - t->mlfqs_epoch < MLFQS_HISTORY);
+
+  if (t->mlfqs_epoch == mlfqs_epoch)
+    return;
+  while (t->mlfqs_epoch != mlfqs_epoch) 
+    {
+      fixed_point_t coefficient;
+
+      t->mlfqs_epoch++;
+      coefficient = decay_history[t->mlfqs_epoch % MLFQS_HISTORY];
+      t->recent_cpu = fp_add_int (fp_mul (coefficient, t->recent_cpu),
+                                  t->nice);
+    }
+  mlfqs_update_priority (t);
+}
+
+/* Recomputes T's priority from its recent_cpu and nice values.
+   T must not be in the run queue. */
+static void
+mlfqs_update_priority (struct thread *t) 
+{
+  int priority = (PRI_MAX - fp_trunc (fp_div_int (t->recent_cpu, 4))
+                  - t->nice * 2);
+
+  if (priority < PRI_MIN)
+    priority = PRI_MIN;
+  else if (priority > PRI_MAX)
+    priority = PRI_MAX;
+  t->priority = priority;
 }
 
 /* Idle thread.  Executes when no other thread is ready to run.
@@ -391,8 +733,8 @@ thread_get_recent_cpu (void)
    point it initializes idle_thread, "up"s the semaphore passed
    to it to enable thread_start() to continue, and immediately
    blocks.  After that, the idle thread never appears in the
-   ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   run queue.  It is returned by next_thread_to_run() as a
+   special case when the run queue is empty. */
 static void
 idle (void *idle_started_ UNUSED) 
 {
@@ -459,6 +801,9 @@ is_thread (struct thread *t)
 static void
 init_thread (struct thread *t, const char *name, int priority)
 {
+  struct thread *parent = running_thread ();
+  enum intr_level old_level;
+
   ASSERT (t != NULL);
   ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
   ASSERT (name != NULL);
@@ -467,9 +812,22 @@ init_thread (struct thread *t, const char *name, int priority)
   t->status = THREAD_BLOCKED;
   strlcpy (t->name, name, sizeof t->name);
   t->stack = (uint8_t *) t + PGSIZE;
-  t->priority = priority;
+  t->priority = t->base_priority = priority;
+  list_init (&t->locks);
   t->magic = THREAD_MAGIC;
+
+  /* The initial thread is its own parent, so it starts out with
+     zero nice and recent_cpu. */
+  t->nice = parent->nice;
+  t->recent_cpu = parent->recent_cpu;
+  t->mlfqs_epoch = mlfqs_epoch;
+  if (thread_mlfqs)
+    mlfqs_update_priority (t);
+
+  old_level = intr_disable ();
   list_push_back (&all_list, &t->allelem);
+  thread_cnt++;
+  intr_set_level (old_level);
 }
 
 /* Allocates a SIZE-byte frame at the top of thread T's stack and
@@ -485,18 +843,97 @@ alloc_frame (struct thread *t, size_t size)
   return t->stack;
 }
 
-/* Chooses and returns the next thread to be scheduled.  Should
-   return a thread from the run queue, unless the run queue is
-   empty.  (If the running thread can continue running, then it
-   will be in the run queue.)  If the run queue is empty, return
-   idle_thread. */
+/* Chooses and returns the next thread to be scheduled.  Returns
+   the thread at the front of the highest-priority nonempty run
+   queue list, unless the run queue is empty.  (If the running
+   thread can continue running, then it will be in the run
+   queue.)  If the run queue is empty, return idle_thread. */
 static struct thread *
 next_thread_to_run (void) 
 {
-  if (list_empty (&ready_list))
+  if (ready_mask == 0)
     return idle_thread;
   else
-    return list_entry (list_pop_front (&ready_list), struct thread, elem);
+    return ready_pop ();
+}
+
+/* Adds T to the back of the run queue list for its priority.
+   Interrupts must be off. */
+static void
+ready_push (struct thread *t) 
+{
+  int pri = t->priority - PRI_MIN;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  list_push_back (&ready_lists[pri], &t->elem);
+  ready_mask |= (uint64_t) 1 << pri;
+  ready_cnt++;
+}
+
+/* Removes and returns the thread at the front of the
+   highest-priority nonempty run queue list.  The run queue must
+   not be empty.  Interrupts must be off. */
+static struct thread *
+ready_pop (void) 
+{
+  int pri;
+  struct list *list;
+  struct thread *t;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (ready_mask != 0);
+
+  pri = highest_bit (ready_mask);
+  list = &ready_lists[pri];
+  t = list_entry (list_pop_front (list), struct thread, elem);
+  if (list_empty (list))
+    ready_mask &= ~((uint64_t) 1 << pri);
+  ready_cnt--;
+  return t;
+}
+
+/* Removes T, which must be in the run queue, from the run
+   queue.  Interrupts must be off. */
+static void
+ready_remove (struct thread *t) 
+{
+  int pri = t->priority - PRI_MIN;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t->status == THREAD_READY);
+
+  list_remove (&t->elem);
+  if (list_empty (&ready_lists[pri]))
+    ready_mask &= ~((uint64_t) 1 << pri);
+  ready_cnt--;
+}
+
+/* Returns the priority of the highest-priority ready thread, or
+   PRI_MIN - 1 if the run queue is empty.  Interrupts must be
+   off. */
+static int
+ready_max_priority (void) 
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  return ready_mask != 0 ? highest_bit (ready_mask) + PRI_MIN : PRI_MIN - 1;
+}
+
+/* Returns the index of the most significant 1-bit in MASK, which
+   must be nonzero.  Uses two 32-bit bit scans because 80x86
+   `bsr' does not operate on 64-bit operands in 32-bit mode. */
+static int
+highest_bit (uint64_t mask) 
+{
+  uint32_t high = mask >> 32;
+
+  ASSERT (mask != 0);
+
+  if (high != 0)
+    return 63 - __builtin_clz (high);
+  else
+    return 31 - __builtin_clz ((uint32_t) mask);
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -1,11 +1,24 @@
 #include "userprog/syscall.h"
+#include <iostat.h>
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
+#include "devices/block.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
 
 static void syscall_handler (struct intr_frame *);
 
+static uint8_t *user_to_kernel (const void *uaddr, bool writable);
+static bool copy_in (void *dst, const void *usrc, size_t size);
+static bool copy_out (void *udst, const void *src, size_t size);
+static int copy_in_string (char *dst, const char *usrc, size_t size);
+
+static bool sys_iostat (const char *udevice, struct iostat *ustats);
+static struct block *find_device (const char *name);
+
 void
 syscall_init (void) 
 {
@@ -13,8 +26,137 @@ syscall_init (void)
 }
 
 static void
-syscall_handler (struct intr_frame *f UNUSED) 
+syscall_handler (struct intr_frame *f) 
 {
+  uint32_t args[2];
+  int number;
+
+  /* A system call number that cannot be read is handled like
+     any other that is not implemented yet. */
+  if (!copy_in (&number, f->esp, sizeof number))
+    number = -1;
+  switch (number) 
+    {
+    case SYS_IOSTAT:
+      if (!copy_in (args, (uint32_t *) f->esp + 1, sizeof args))
+        thread_exit ();
+      f->eax = sys_iostat ((const char *) args[0],
+                           (struct iostat *) args[1]);
+      return;
+    }
+
   printf ("system call!\n");
   thread_exit ();
 }
+
+/* Iostat system call: copies the I/O statistics of the block
+   device named UDEVICE to USTATS.  Returns false if there is no
+   such device.  Terminates the process if either pointer is
+   bad. */
+static bool
+sys_iostat (const char *udevice, struct iostat *ustats) 
+{
+  char name[16];
+  int copied;
+  struct block *block;
+  struct iostat stats;
+
+  copied = copy_in_string (name, udevice, sizeof name);
+  if (copied < 0)
+    thread_exit ();
+  if (copied == 0)
+    return false;
+  block = find_device (name);
+  if (block == NULL)
+    return false;
+  block_get_iostat (block, &stats);
+  if (!copy_out (ustats, &stats, sizeof stats))
+    thread_exit ();
+  return true;
+}
+
+/* Returns the block device named NAME, such as "hda2", or the
+   one that plays the role named NAME, such as "filesys", or a
+   null pointer if there is none. */
+static struct block *
+find_device (const char *name) 
+{
+  struct block *block = block_get_by_name (name);
+  enum block_type role;
+
+  for (role = 0; block == NULL && role < BLOCK_ROLE_CNT; role++)
+    if (!strcmp (name, block_type_name (role)))
+      block = block_get_role (role);
+  return block;
+}
+
+/* Returns the kernel address of user address UADDR in the
+   running process, or a null pointer if UADDR is not mapped, or,
+   if WRITABLE is true, is not writable. */
+static uint8_t *
+user_to_kernel (const void *uaddr, bool writable) 
+{
+  uint32_t *pd = thread_current ()->pagedir;
+
+  if (pd == NULL || !is_user_vaddr (uaddr)
+      || (writable && !pagedir_is_writable (pd, uaddr)))
+    return NULL;
+  return pagedir_get_page (pd, uaddr);
+}
+
+/* Copies SIZE bytes from user address USRC to kernel address
+   DST.  Returns true if successful, false if any of them is not
+   mapped. */
+static bool
+copy_in (void *dst_, const void *usrc_, size_t size) 
+{
+  uint8_t *dst = dst_;
+  const uint8_t *usrc = usrc_;
+
+  for (; size > 0; size--) 
+    {
+      const uint8_t *src = user_to_kernel (usrc++, false);
+      if (src == NULL)
+        return false;
+      *dst++ = *src;
+    }
+  return true;
+}
+
+/* Copies SIZE bytes from kernel address SRC to user address
+   UDST.  Returns true if successful, false if any of them is not
+   mapped writable. */
+static bool
+copy_out (void *udst_, const void *src_, size_t size) 
+{
+  uint8_t *udst = udst_;
+  const uint8_t *src = src_;
+
+  for (; size > 0; size--) 
+    {
+      uint8_t *dst = user_to_kernel (udst++, true);
+      if (dst == NULL)
+        return false;
+      *dst = *src++;
+    }
+  return true;
+}
+
+/* Copies the null-terminated string at user address USRC into
+   DST, which has room for SIZE bytes.  Returns 1 if successful,
+   0 if the string does not fit, or -1 if it is not mapped.  DST's
+   contents are undefined on failure. */
+static int
+copy_in_string (char *dst, const char *usrc, size_t size) 
+{
+  size_t i;
+
+  for (i = 0; i < size; i++) 
+    {
+      if (!copy_in (&dst[i], usrc + i, 1))
+        return -1;
+      if (dst[i] == '\0')
+        return 1;
+    }
+  return 0;
+}
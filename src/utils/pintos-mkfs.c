@@ -0,0 +1,470 @@
+/* Builds a Pintos file system partition image on the host.
+
+   The image has the same layout that the kernel's do_format()
+   produces, followed by the equivalent of filesys_create() and
+   file_write() for each file named on the command line, so the
+   kernel can boot with the files already present instead of
+   extracting them from a scratch disk with fsutil_extract().
+   Use the image as the file system partition, e.g. with
+   "pintos --filesys=IMAGE".
+
+   The on-disk structures below must match filesys/filesys.h,
+   filesys/inode.c, filesys/directory.c, filesys/journal.c and
+   the free map's bitmap, lib/kernel/bitmap.c, as compiled for
+   the i386. */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+
+/* From filesys/filesys.h. */
+#define FREE_MAP_SECTOR 0
+#define ROOT_DIR_SECTOR 1
+#define JOURNAL_SECTOR 2
+#define JOURNAL_SECTORS 33
+
+/* From filesys/journal.c. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* From filesys/inode.c. */
+#define INODE_MAGIC 0x494e4f44
+#define DIRECT_CNT 123
+#define PTRS_PER_SECTOR (SECTOR_SIZE / sizeof (uint32_t))
+#define MAX_SECTORS (DIRECT_CNT + PTRS_PER_SECTOR \
+                     + PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+#define INLINE_MAX ((DIRECT_CNT + 2) * sizeof (uint32_t))
+
+struct inode_disk
+  {
+    int32_t length;
+    uint32_t magic;
+    uint16_t is_dir;
+    uint16_t is_inline;
+    union
+      {
+        struct
+          {
+            uint32_t direct[DIRECT_CNT];
+            uint32_t indirect;
+            uint32_t dbl_indirect;
+          };
+        uint8_t inline_data[INLINE_MAX];
+      };
+  };
+
+/* From filesys/directory.h and filesys/directory.c. */
+#define NAME_MAX 14
+#define DIR_MAGIC 0x44495248
+#define BUCKET_ENTRIES 25
+#define SPLIT_LOAD (BUCKET_ENTRIES * 3 / 4)
+#define MAX_BUCKETS 4096
+#define OVERFLOW_BASE (1 + MAX_BUCKETS)
+
+struct dir_entry
+  {
+    uint32_t inode_sector;
+    char name[NAME_MAX + 1];
+    uint8_t in_use;
+  };
+
+struct dir_header
+  {
+    uint32_t magic;
+    uint32_t level;
+    uint32_t split;
+    uint32_t entry_cnt;
+    uint32_t overflow_cnt;
+    uint32_t parent;
+  };
+
+struct dir_bucket
+  {
+    struct dir_entry entries[BUCKET_ENTRIES];
+    uint32_t next;
+    uint8_t unused[8];
+  };
+
+/* The image being built. */
+static const char *program_name;
+static uint8_t *disk;                   /* Contents, sector_cnt sectors. */
+static uint32_t sector_cnt;             /* Size of image in sectors. */
+static uint32_t *free_map;              /* One bit per sector, 1 = used. */
+static uint32_t next_free;              /* Where allocation resumes. */
+
+static void usage (void);
+static void fail (const char *format, ...);
+static void *xcalloc (size_t cnt, size_t size);
+static uint8_t *sector_ptr (uint32_t sector);
+static void mark (uint32_t sector);
+static uint32_t allocate (void);
+static uint32_t *data_ptr (struct inode_disk *, size_t idx);
+static void write_inode (uint32_t sector, const uint8_t *data,
+                         size_t length, bool is_dir, bool sparse);
+static uint32_t add_file (const char *host_name, size_t *length);
+static void write_root (struct dir_entry *entries, size_t entry_cnt);
+
+int
+main (int argc, char *argv[])
+{
+  double size_mb = 2.0;
+  const char *image_name;
+  struct dir_entry *entries;
+  size_t entry_cnt, free_map_size;
+  uint32_t free_map_sectors;
+  size_t total = 0;
+  FILE *image;
+  int opt, i;
+
+  program_name = argv[0];
+  while ((opt = getopt (argc, argv, "s:h")) != -1)
+    switch (opt)
+      {
+      case 's':
+        size_mb = strtod (optarg, NULL);
+        break;
+      default:
+        usage ();
+      }
+  if (optind >= argc)
+    usage ();
+  image_name = argv[optind++];
+
+  /* Set up an empty image with the sectors that do_format()
+     reserves marked in use. */
+  sector_cnt = size_mb * 1024 * 1024 / SECTOR_SIZE;
+  if (sector_cnt < JOURNAL_SECTOR + JOURNAL_SECTORS + 1)
+    fail ("%s: file system size too small", image_name);
+  disk = xcalloc (sector_cnt, SECTOR_SIZE);
+  free_map = xcalloc ((sector_cnt + 31) / 32, sizeof *free_map);
+  mark (FREE_MAP_SECTOR);
+  mark (ROOT_DIR_SECTOR);
+  for (i = 0; i < JOURNAL_SECTORS; i++)
+    mark (JOURNAL_SECTOR + i);
+  next_free = JOURNAL_SECTOR + JOURNAL_SECTORS;
+
+  /* An empty journal. */
+  ((uint32_t *) sector_ptr (JOURNAL_SECTOR))[0] = JOURNAL_MAGIC;
+
+  /* Reserve space for the free map's own data, which is written
+     last, once every allocation is done.  The kernel writes the
+     free map in place, so it must not have holes. */
+  free_map_size = (sector_cnt + 31) / 32 * sizeof *free_map;
+  free_map_sectors = 0;
+  if (free_map_size > INLINE_MAX)
+    {
+      uint8_t *zeros = xcalloc (1, free_map_size);
+      write_inode (FREE_MAP_SECTOR, zeros, free_map_size, false, false);
+      free (zeros);
+      free_map_sectors = (free_map_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+
+  /* Add each file to the root directory. */
+  entries = xcalloc (argc - optind + 1, sizeof *entries);
+  entry_cnt = 0;
+  for (; optind < argc; optind++)
+    {
+      char *host_name = argv[optind];
+      char *guest_name = strchr (host_name, '=');
+      struct dir_entry *e = &entries[entry_cnt];
+      size_t length, j;
+
+      if (guest_name != NULL)
+        *guest_name++ = '\0';
+      else
+        {
+          guest_name = strrchr (host_name, '/');
+          guest_name = guest_name != NULL ? guest_name + 1 : host_name;
+        }
+      if (*guest_name == '\0' || strlen (guest_name) > NAME_MAX
+          || strchr (guest_name, '/') != NULL
+          || !strcmp (guest_name, ".") || !strcmp (guest_name, ".."))
+        fail ("%s: invalid file name in the root directory", guest_name);
+      for (j = 0; j < entry_cnt; j++)
+        if (!strcmp (entries[j].name, guest_name))
+          fail ("%s: file name used twice", guest_name);
+
+      e->inode_sector = add_file (host_name, &length);
+      strcpy (e->name, guest_name);
+      e->in_use = 1;
+      entry_cnt++;
+      total += length;
+    }
+  write_root (entries, entry_cnt);
+  free (entries);
+
+  /* Now that the free map is final, write it. */
+  if (free_map_sectors > 0)
+    {
+      struct inode_disk *fm
+        = (struct inode_disk *) sector_ptr (FREE_MAP_SECTOR);
+      uint8_t *src = (uint8_t *) free_map;
+      uint32_t s;
+
+      for (s = 0; s < free_map_sectors; s++)
+        {
+          size_t chunk = free_map_size - s * SECTOR_SIZE;
+          if (chunk > SECTOR_SIZE)
+            chunk = SECTOR_SIZE;
+          memcpy (sector_ptr (*data_ptr (fm, s)), src + s * SECTOR_SIZE,
+                  chunk);
+        }
+    }
+  else
+    write_inode (FREE_MAP_SECTOR, (uint8_t *) free_map, free_map_size,
+                 false, false);
+
+  /* Write the image. */
+  image = fopen (image_name, "wb");
+  if (image == NULL)
+    fail ("%s: open failed: %s", image_name, strerror (errno));
+  if (fwrite (disk, SECTOR_SIZE, sector_cnt, image) != sector_cnt
+      || fclose (image) != 0)
+    fail ("%s: write failed: %s", image_name, strerror (errno));
+
+  printf ("%s: %u sectors, %zu files, %zu bytes of data, "
+          "%u sectors free\n",
+          image_name, (unsigned) sector_cnt, entry_cnt, total,
+          (unsigned) (sector_cnt - next_free));
+  return EXIT_SUCCESS;
+}
+
+/* Prints a usage message and exits. */
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "pintos-mkfs: builds a Pintos file system partition image\n"
+           "usage: %s [-s SIZE] IMAGE [HOSTFN[=GUESTFN]...]\n"
+           "  where SIZE is the partition size in MB (default: 2),\n"
+           "    IMAGE is the image file to create, and each HOSTFN\n"
+           "    is copied into the root directory as GUESTFN, by\n"
+           "    default under the same name.\n",
+           program_name);
+  exit (EXIT_FAILURE);
+}
+
+/* Prints an error message, formatted like printf(), and exits. */
+static void
+fail (const char *format, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s: ", program_name);
+  va_start (args, format);
+  vfprintf (stderr, format, args);
+  va_end (args);
+  fputc ('\n', stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Like calloc(), but exits if memory runs out. */
+static void *
+xcalloc (size_t cnt, size_t size)
+{
+  void *p = calloc (cnt, size);
+  if (p == NULL)
+    fail ("out of memory");
+  return p;
+}
+
+/* Returns the contents of SECTOR in the image. */
+static uint8_t *
+sector_ptr (uint32_t sector)
+{
+  return disk + (size_t) sector * SECTOR_SIZE;
+}
+
+/* Marks SECTOR in use in the free map. */
+static void
+mark (uint32_t sector)
+{
+  free_map[sector / 32] |= (uint32_t) 1 << (sector % 32);
+}
+
+/* Allocates a zeroed sector and returns it. */
+static uint32_t
+allocate (void)
+{
+  if (next_free >= sector_cnt)
+    fail ("file system is full");
+  mark (next_free);
+  return next_free++;
+}
+
+/* Writes to SECTOR an inode for a file of LENGTH bytes with the
+   given DATA, allocating its data sectors.  Small files are
+   stored inline.  If SPARSE is true, sectors of DATA that are
+   all zeros are left as holes. */
+static void
+write_inode (uint32_t sector, const uint8_t *data, size_t length,
+             bool is_dir, bool sparse)
+{
+  struct inode_disk *inode = (struct inode_disk *) sector_ptr (sector);
+  size_t sectors = (length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  size_t idx;
+
+  if (sectors > MAX_SECTORS)
+    fail ("file too large");
+
+  memset (inode, 0, sizeof *inode);
+  inode->length = length;
+  inode->magic = INODE_MAGIC;
+  inode->is_dir = is_dir;
+  if (length <= INLINE_MAX)
+    {
+      inode->is_inline = 1;
+      memcpy (inode->inline_data, data, length);
+      return;
+    }
+
+  for (idx = 0; idx < sectors; idx++)
+    {
+      const uint8_t *src = data + idx * SECTOR_SIZE;
+      size_t chunk = length - idx * SECTOR_SIZE;
+      uint32_t *ptr;
+      size_t i;
+
+      if (chunk > SECTOR_SIZE)
+        chunk = SECTOR_SIZE;
+      if (sparse)
+        {
+          for (i = 0; i < chunk && src[i] == 0; i++)
+            continue;
+          if (i == chunk)
+            continue;
+        }
+
+      ptr = data_ptr (inode, idx);
+      *ptr = allocate ();
+      memcpy (sector_ptr (*ptr), src, chunk);
+    }
+}
+
+/* Returns the pointer to data sector IDX in INODE, allocating
+   pointer blocks on the way as index_to_sector() would. */
+static uint32_t *
+data_ptr (struct inode_disk *inode, size_t idx)
+{
+  uint32_t *block;
+
+  if (idx < DIRECT_CNT)
+    return &inode->direct[idx];
+  idx -= DIRECT_CNT;
+
+  if (idx < PTRS_PER_SECTOR)
+    {
+      if (inode->indirect == 0)
+        inode->indirect = allocate ();
+      block = (uint32_t *) sector_ptr (inode->indirect);
+      return &block[idx];
+    }
+  idx -= PTRS_PER_SECTOR;
+
+  if (inode->dbl_indirect == 0)
+    inode->dbl_indirect = allocate ();
+  block = (uint32_t *) sector_ptr (inode->dbl_indirect);
+  if (block[idx / PTRS_PER_SECTOR] == 0)
+    block[idx / PTRS_PER_SECTOR] = allocate ();
+  block = (uint32_t *) sector_ptr (block[idx / PTRS_PER_SECTOR]);
+  return &block[idx % PTRS_PER_SECTOR];
+}
+
+/* Copies host file HOST_NAME into a new inode, stores its length
+   in *LENGTH, and returns the inode's sector. */
+static uint32_t
+add_file (const char *host_name, size_t *length)
+{
+  uint32_t sector = allocate ();
+  uint8_t *data;
+  struct stat st;
+  FILE *file;
+
+  file = fopen (host_name, "rb");
+  if (file == NULL || fstat (fileno (file), &st) < 0)
+    fail ("%s: open failed: %s", host_name, strerror (errno));
+  *length = st.st_size;
+  data = xcalloc (1, *length + 1);
+  if (fread (data, 1, *length, file) != *length)
+    fail ("%s: read failed", host_name);
+  fclose (file);
+
+  write_inode (sector, data, *length, false, false);
+  free (data);
+  return sector;
+}
+
+/* Returns FNV-1 hash of S, as hash_string() computes it. */
+static uint32_t
+hash_string (const char *s_)
+{
+  const unsigned char *s = (const unsigned char *) s_;
+  uint32_t hash = 2166136261u;
+
+  while (*s != '\0')
+    hash = (hash * 16777619u) ^ *s++;
+  return hash;
+}
+
+/* Writes the root directory, with the ENTRY_CNT entries in
+   ENTRIES.  The hash table is sized as dir_create() would size
+   it for that many entries, so it needs no splits. */
+static void
+write_root (struct dir_entry *entries, size_t entry_cnt)
+{
+  struct dir_header h;
+  struct dir_bucket *blocks;
+  size_t block_cnt, last, i;
+
+  h.magic = DIR_MAGIC;
+  h.level = 0;
+  while ((1u << h.level) * SPLIT_LOAD < entry_cnt
+         && (2u << h.level) <= MAX_BUCKETS)
+    h.level++;
+  h.split = 0;
+  h.entry_cnt = entry_cnt;
+  h.overflow_cnt = 0;
+  h.parent = ROOT_DIR_SECTOR;
+
+  /* Lay out the directory's blocks: the header, the primary
+     buckets, and, if any bucket fills up, overflow buckets. */
+  block_cnt = OVERFLOW_BASE + entry_cnt;
+  blocks = xcalloc (block_cnt, sizeof *blocks);
+  last = 0;
+  for (i = 0; i < entry_cnt; i++)
+    {
+      uint32_t block = 1 + (hash_string (entries[i].name)
+                            & ((1u << h.level) - 1));
+      size_t slot;
+
+      for (;;)
+        {
+          struct dir_bucket *b = &blocks[block];
+
+          for (slot = 0; slot < BUCKET_ENTRIES; slot++)
+            if (!b->entries[slot].in_use)
+              break;
+          if (slot < BUCKET_ENTRIES)
+            break;
+          if (b->next == 0)
+            b->next = OVERFLOW_BASE + h.overflow_cnt++;
+          block = b->next;
+        }
+      blocks[block].entries[slot] = entries[i];
+      if (block > last)
+        last = block;
+    }
+  memcpy (&blocks[0], &h, sizeof h);
+
+  write_inode (ROOT_DIR_SECTOR, (uint8_t *) blocks,
+               last > 0 ? (last + 1) * SECTOR_SIZE : sizeof h, true, true);
+  free (blocks);
+}